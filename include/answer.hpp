@@ -0,0 +1,114 @@
+#ifndef ANSWER_HPP_
+#define ANSWER_HPP_
+
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "collection.hpp"
+#include "packet.hpp"
+#include "record.hpp"
+#include "strategy.hpp"
+
+// The answer, authority and additional sections of a response, already in
+// wire format, together with their record counts. `pointers` lists where
+// the compression pointers sit, so the sections can be moved behind a
+// longer question that ends in the same name.
+struct AnswerView {
+    uint16_t ancount;
+    uint16_t nscount;
+    uint16_t arcount;
+    size_t question_end;
+    const uint8_t* sections;
+    size_t sections_len;
+    const uint16_t* pointers;
+    size_t n_pointers;
+
+    auto write(const PacketView& query, uint8_t* out, size_t size) const
+        -> size_t;
+};
+
+// Where authoritative answers are served from: rendered in memory from the
+// zone files, or mapped from a compiled zone image.
+class AnswerSource {
+   public:
+    virtual ~AnswerSource() = default;
+    virtual auto find_zone(std::string_view qname) const
+        -> std::optional<std::string_view> = 0;
+    virtual auto find(std::string_view qname, uint16_t qtype) const
+        -> std::optional<AnswerView> = 0;
+    virtual auto find_missing(std::string_view domain) const
+        -> std::optional<AnswerView> = 0;
+};
+
+struct Answer {
+    std::string owner;
+    uint16_t qtype;
+    uint16_t ancount;
+    uint16_t nscount;
+    uint16_t arcount;
+    size_t question_end;
+    std::vector<uint8_t> sections;
+    std::vector<uint16_t> pointers;
+    bool removed = false;
+
+    auto view() const -> AnswerView;
+};
+
+// Zone data never changes while serving, so every (owner, qtype) answer and
+// every zone's not-found answer is rendered once by the registered
+// responders. Serving a query then only copies the template behind the
+// client's header and question.
+//
+// A table built over a `base` is a layer holding only the answers rendered
+// again after a dynamic update; everything else is looked up in the base.
+class AnswerTable : public AnswerSource {
+   public:
+    std::shared_ptr<const AnswerTable> base;
+
+    AnswerTable() = default;
+    explicit AnswerTable(std::shared_ptr<const AnswerTable> base)
+        : base(std::move(base)) {}
+
+    auto render(
+        const Collection& collection,
+        const std::map<Record::Type, std::shared_ptr<QueryResponder>>& handlers)
+        -> void;
+    auto rerender(
+        const Collection& collection,
+        const std::map<Record::Type, std::shared_ptr<QueryResponder>>& handlers,
+        const std::string& owner, uint16_t qtype) -> void;
+    auto rerender_missing(const Collection& collection,
+                          const std::string& domain) -> void;
+    auto flatten() const -> AnswerTable;
+
+    auto find_zone(std::string_view qname) const
+        -> std::optional<std::string_view> override;
+    auto find(std::string_view qname, uint16_t qtype) const
+        -> std::optional<AnswerView> override;
+    auto find_missing(std::string_view domain) const
+        -> std::optional<AnswerView> override;
+
+    auto domains() const -> const std::vector<std::string>&;
+    auto entries() const -> const std::vector<Answer>&;
+
+   private:
+    ZoneTrie zones;
+    std::vector<std::string> zone_names;
+    std::vector<Answer> answers;
+    std::unordered_multimap<size_t, uint32_t> index;
+    std::unordered_multimap<size_t, uint32_t> missing;
+
+    auto add(std::unordered_multimap<size_t, uint32_t>& table, Answer answer)
+        -> void;
+    auto lookup(const std::unordered_multimap<size_t, uint32_t>& table,
+                std::string_view owner, uint16_t qtype) const -> const Answer*;
+    auto table_of(uint16_t qtype) const
+        -> const std::unordered_multimap<size_t, uint32_t>&;
+};
+
+#endif
@@ -1,21 +1,55 @@
 #ifndef BUILDER_HPP_
 #define BUILDER_HPP_
 
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "loader.hpp"
 #include "packet.hpp"
 #include "server.hpp"
 
+// Reads upstreams separated by commas, each as an IPv4 address with an
+// optional ":port", as the first config line lists them. Ends the process
+// on an entry it can't read.
+auto parse_upstreams(const std::string& line) -> std::vector<sockaddr_in>;
+
 class ServerBuilder {
    public:
     Server server;
     auto load_config(const fs::path& config_path) -> ServerBuilder&;
+    auto set_loaders(size_t n_loaders) -> ServerBuilder&;
+    auto set_update_allow(const std::vector<std::string>& addresses)
+        -> ServerBuilder&;
+    auto set_workers(size_t n_workers) -> ServerBuilder&;
+    auto set_batch_size(size_t batch_size) -> ServerBuilder&;
+    auto set_edns_size(size_t edns_size) -> ServerBuilder&;
+    auto set_backend(Backend backend) -> ServerBuilder&;
+    auto set_stats_socket(std::string path) -> ServerBuilder&;
+    auto set_cache_size(size_t cache_size) -> ServerBuilder&;
+    auto set_prefetch(size_t percent, size_t min_hits) -> ServerBuilder&;
+    auto set_tcp_connections(size_t tcp_connections) -> ServerBuilder&;
+    auto set_rate_limit(size_t rate, size_t slip) -> ServerBuilder&;
     auto bind(uint16_t port) -> Server;
+    auto compile(const fs::path& image_path) -> void;
     auto register_fn(Record::Type type, std::shared_ptr<QueryResponder> handler)
         -> ServerBuilder&;
+    auto register_defaults() -> ServerBuilder&;
 
    private:
     std::string forward_ip;
-
-    void load_zone(const fs::path& zone_path);
+    size_t n_workers = 1;
+    size_t cache_size = DEFAULT_CACHE_SIZE;
+    size_t prefetch_percent = DEFAULT_PREFETCH_PERCENT;
+    size_t prefetch_hits = DEFAULT_PREFETCH_HITS;
+    size_t tcp_connections = DEFAULT_TCP_CONNECTIONS;
+    size_t rrl_rate = 0;
+    size_t rrl_slip = DEFAULT_RRL_SLIP;
+    std::string stats_path;
+    ZoneLoader loader;
+    std::vector<in_addr_t> update_allowed = {htonl(INADDR_LOOPBACK)};
+    std::unique_ptr<Snapshot> snapshot;
 };
 
 class RecordBuilder {
@@ -28,7 +62,12 @@ class RecordBuilder {
     auto set_ttl(const std::string& ttl) -> RecordBuilder&;
     auto set_rdata(const std::vector<std::string>& data) -> RecordBuilder&;
 
-    auto build() -> Record;
+    auto build() -> std::optional<Record>;
+
+   private:
+    std::vector<std::string> rdata;
+
+    auto parse_rdata() -> std::optional<RData>;
 };
 
 class HeaderBuilder {
@@ -40,16 +79,28 @@ class HeaderBuilder {
     Header header;
 };
 
-class PacketBuilder {
+// Assembles a response and compresses every name against the names already
+// in the message (RFC 1035 4.1.4), so repeated owners and shared suffixes
+// cost two bytes each. Once a write would pass PACKET_SIZE, it and every
+// later write are dropped and create() returns nothing.
+class ResponseWriter {
    public:
-    PacketBuilder() : nbytes(0) {}
-    auto write(void* data, size_t nbytes) -> PacketBuilder&;
-    auto create() -> Packet;
+    ResponseWriter() : nbytes(0), overflow(false) {}
+    auto write(const void* data, size_t nbytes) -> ResponseWriter&;
+    auto name(std::string_view name) -> ResponseWriter&;
+    auto question(const Query& query) -> ResponseWriter&;
+    auto record(std::string_view owner, const Record& record)
+        -> ResponseWriter&;
+    auto create() -> std::optional<Packet>;
 
    private:
     Packet packet;
     uint8_t buffer[PACKET_SIZE];
     size_t nbytes;
+    bool overflow;
+    std::vector<std::pair<std::string, uint16_t>> suffixes;
+
+    auto rdata(const Record& record) -> ResponseWriter&;
 };
 
 #endif
\ No newline at end of file
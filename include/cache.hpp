@@ -0,0 +1,84 @@
+#ifndef CACHE_HPP_
+#define CACHE_HPP_
+
+#include <array>
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "packet.hpp"
+
+constexpr size_t DEFAULT_CACHE_SIZE = 64 << 20;
+constexpr size_t CACHE_SHARDS = 16;
+constexpr uint32_t MAX_CACHE_TTL = 86400;
+
+// An entry hit at least DEFAULT_PREFETCH_HITS times is refreshed from the
+// upstream once no more than DEFAULT_PREFETCH_PERCENT of its TTL is left.
+constexpr size_t DEFAULT_PREFETCH_PERCENT = 10;
+constexpr uint32_t DEFAULT_PREFETCH_HITS = 8;
+
+// An upstream answer in wire format, with the offset of every TTL field so
+// the remaining lifetime can be written back on each hit. `refreshing` is
+// when a prefetch last went out for it.
+struct CacheEntry {
+    std::string qname;
+    uint16_t qtype;
+    uint16_t qclass;
+    size_t hash;
+    std::vector<uint8_t> wire;
+    std::vector<uint16_t> ttl_offsets;
+    std::chrono::steady_clock::time_point stored;
+    std::chrono::steady_clock::time_point expires;
+    uint32_t hits = 0;
+    std::chrono::steady_clock::time_point refreshing;
+
+    auto size() const -> size_t;
+};
+
+// Caches forwarded responses by (qname, qtype, qclass) until the smallest
+// answer TTL runs out. The key space is split over CACHE_SHARDS shards, each
+// with its own lock and LRU list, and every shard evicts on its own share of
+// the byte budget so workers rarely contend.
+//
+// Entries count their hits. A lookup that finds a popular entry near the
+// end of its TTL sets `refresh`, so the caller can fetch it again while
+// clients are still answered from the cache. It is set again for the same
+// entry only once FORWARD_TIMEOUT has passed, in case that refresh was
+// lost. The new entry inherits half the old one's hits, so a name that
+// cools down stops being refreshed.
+class ResponseCache {
+   public:
+    ResponseCache(size_t capacity, size_t prefetch_percent,
+                  uint32_t prefetch_hits);
+
+    auto lookup(const PacketView& query, uint8_t* out, size_t size,
+                bool& refresh) -> size_t;
+    auto store(const uint8_t* wire, size_t len) -> void;
+
+   private:
+    using Iterator = std::list<CacheEntry>::iterator;
+
+    struct Shard {
+        std::mutex mutex;
+        std::list<CacheEntry> lru;
+        std::unordered_multimap<size_t, Iterator> index;
+        size_t bytes = 0;
+    };
+
+    size_t shard_capacity;
+    size_t prefetch_percent;
+    uint32_t prefetch_hits;
+    std::array<Shard, CACHE_SHARDS> shards;
+
+    static auto find(Shard& shard, size_t hash, std::string_view qname,
+                     uint16_t qtype, uint16_t qclass)
+        -> std::optional<Iterator>;
+    static auto evict(Shard& shard, Iterator it) -> void;
+};
+
+#endif
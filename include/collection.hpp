@@ -2,22 +2,91 @@
 #define COLLECTION_HPP_
 
 #include <map>
+#include <memory>
 #include <optional>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
 #include "record.hpp"
 
+// Hosted zones indexed by their labels from the root down, so the closest
+// enclosing zone of a name is found in one pass over its labels. Children
+// are keyed by the hash of their label and checked against the stored label.
+class ZoneTrie {
+   public:
+    ZoneTrie();
+
+    auto insert(const std::string& zone) -> void;
+    auto find(std::string_view qname) const -> const std::string*;
+
+   private:
+    struct Node {
+        std::string label;
+        std::optional<std::string> zone;
+        std::unordered_multimap<size_t, uint32_t> children;
+    };
+
+    std::vector<Node> nodes;
+
+    auto child(uint32_t parent, std::string_view label) const
+        -> std::optional<uint32_t>;
+};
+
+// A non-owning view of the records of one RRset.
+class RecordSpan {
+   public:
+    RecordSpan() = default;
+    RecordSpan(const Record* data, size_t count) : data(data), count(count) {}
+
+    auto begin() const -> const Record* { return this->data; }
+    auto end() const -> const Record* { return this->data + this->count; }
+    auto size() const -> size_t { return this->count; }
+    auto empty() const -> bool { return this->count == 0; }
+    auto operator[](size_t i) const -> const Record& { return this->data[i]; }
+
+   private:
+    const Record* data = nullptr;
+    size_t count = 0;
+};
+
+// All records sharing an owner name, type and class.
+struct RRset {
+    std::string owner;
+    uint16_t r_type;
+    uint16_t r_class;
+    std::vector<Record> records;
+};
+
+// Zones and their RRsets. A collection built over a `base` is a
+// copy-on-write layer: it only holds the RRsets replaced since the base, an
+// empty RRset standing for a deleted one, and leaves zones to the base.
 class Collection {
    public:
-    std::map<std::string, std::vector<Record>> records;
+    std::vector<std::string> domains;
+    std::vector<RRset> rrsets;
+    ZoneTrie zones;
+    std::shared_ptr<const Collection> base;
+
+    Collection() = default;
+    explicit Collection(std::shared_ptr<const Collection> base)
+        : base(std::move(base)) {}
 
     auto add_record(const std::string& domain, const Record& record) -> void;
+    auto replace(RRset rrset) -> void;
+    auto flatten() const -> Collection;
 
     auto search_domain(const std::string& qname) const
         -> std::optional<std::string>;
     auto search_records(const std::string& qname, uint16_t qtype,
-                        uint16_t qclass) const -> std::vector<Record>;
+                        uint16_t qclass) const -> RecordSpan;
+
+   private:
+    std::unordered_multimap<size_t, uint32_t> index;
+
+    auto find_rrset(std::string_view owner, uint16_t qtype,
+                    uint16_t qclass) const -> const RRset*;
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,169 @@
+#ifndef FORWARDER_HPP_
+#define FORWARDER_HPP_
+
+#include <arpa/inet.h>
+
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "metrics.hpp"
+#include "packet.hpp"
+
+using ErrorMessage = std::string;
+using Clock = std::chrono::steady_clock;
+
+constexpr auto FORWARD_TIMEOUT = std::chrono::seconds(2);
+constexpr size_t MAX_UPSTREAMS = 14;
+
+// Each attempt waits four smoothed RTTs within these bounds before the
+// query is tried again, so a slow upstream leaves time for another.
+constexpr auto UPSTREAM_MIN_RTO = std::chrono::milliseconds(400);
+constexpr auto UPSTREAM_MAX_RTO = std::chrono::seconds(1);
+
+// An upstream whose error rate reaches UPSTREAM_MAX_ERROR_RATE, about
+// three timeouts in a row, is passed over for UPSTREAM_RETRY after each
+// failure. One query in UPSTREAM_EXPLORE goes to another healthy upstream,
+// so the RTTs of those not chosen stay current.
+constexpr double UPSTREAM_MAX_ERROR_RATE = 0.3;
+constexpr auto UPSTREAM_RETRY = std::chrono::seconds(1);
+constexpr unsigned UPSTREAM_EXPLORE = 64;
+
+// At most this many clients wait on one upstream query; the next identical
+// query starts another.
+constexpr size_t MAX_COALESCED = 1024;
+
+// Queries from TCP clients go upstream over TCP, one connection each, at
+// most this many at a time per worker. epoll ids with EPOLL_UPSTREAM_STREAM
+// set name those connections.
+constexpr size_t MAX_UPSTREAM_STREAMS = 256;
+constexpr uint64_t EPOLL_UPSTREAM_STREAM = 1ULL << 62;
+
+// Who asked: a UDP client, or the TCP connection `stream` when it is not 0,
+// and when the query arrived.
+struct Client {
+    sockaddr_in addr;
+    uint64_t stream;
+    Clock::time_point received;
+};
+
+// One upstream server as a worker sees it, through a socket connected to
+// it. The RTT and error rate are moving averages over this worker's
+// queries (RFC 6298 weights); a timeout doubles the RTT so the upstream
+// loses its place until it answers again.
+struct Upstream {
+    sockaddr_in addr;
+    int sock = -1;
+    std::chrono::nanoseconds srtt{0};
+    double error_rate = 0;
+    bool penalized = false;
+    Clock::time_point skip_until;
+
+    auto healthy(Clock::time_point now) const -> bool;
+    auto rto() const -> Clock::duration;
+    auto succeed(std::chrono::nanoseconds rtt) -> void;
+    auto fail(Clock::time_point now) -> void;
+};
+
+// A client waiting on an upstream query, with the header it asked with and
+// whether it sent an OPT record, so a reply built here can carry one too.
+struct Waiter {
+    Header header;
+    Client client;
+    bool edns = false;
+};
+
+// A query sent upstream under a fresh ID, waiting for its answer on behalf
+// of every client that asked the same while it was out. `wire` keeps the
+// query as sent, so it can be tried again on another upstream, and `key`
+// is what later queries must match to join it. `refused` marks a query
+// whose upstream refused it, already counted against that upstream.
+struct PendingQuery {
+    Query query;
+    std::vector<Waiter> waiters;
+    std::string key;
+    Clock::time_point deadline;
+    Clock::time_point sent;
+    Clock::time_point retry_at;
+    size_t upstream;
+    std::vector<uint8_t> wire;
+    bool refused = false;
+};
+
+// A query from TCP clients on its own TCP connection to an upstream, so an
+// answer too large for a datagram reaches them whole (RFC 7766). `out`
+// holds the framed query from `sent` on, and `in` the framed answer as it
+// arrives. A failed exchange closes `fd` and is answered with SERVFAIL at
+// the next expiry.
+struct UpstreamStream {
+    int fd;
+    Query query;
+    std::vector<Waiter> waiters;
+    std::string key;
+    std::vector<uint8_t> out;
+    size_t sent = 0;
+    std::vector<uint8_t> in;
+    Clock::time_point deadline;
+};
+
+// Relays queries to the fastest healthy upstream without waiting for the
+// answer. Each query is sent under a new random ID and remembered in a pending
+// table keyed by that ID; replies are matched back by ID and question and
+// handed out to every waiting client. A query identical to one already out
+// joins it instead of going upstream again. A query not answered within its
+// upstream's RTO is sent again, to another upstream when there is one, and gets
+// SERVFAIL once FORWARD_TIMEOUT has passed. A prefetch goes out the same way
+// with no client waiting, only so its answer refreshes the cache. Queries
+// from TCP clients take an UpstreamStream on the worker's epoll set instead,
+// and join only each other. A Forwarder belongs to one worker thread and is
+// not thread-safe.
+class Forwarder {
+   public:
+    std::vector<Upstream> upstreams;
+    std::shared_ptr<WorkerMetrics> metrics;
+    int epoll_fd = -1;
+
+    auto submit(const PacketView& query, const Client& client)
+        -> std::optional<ErrorMessage>;
+    auto prefetch(const PacketView& query, bool& sent)
+        -> std::optional<ErrorMessage>;
+    auto receive(size_t upstream, uint8_t* out, size_t size)
+        -> std::optional<std::pair<size_t, std::vector<Waiter>>>;
+    auto match(size_t upstream, const uint8_t* data, size_t len)
+        -> std::optional<std::vector<Waiter>>;
+    auto stream_ready(uint64_t id, uint32_t events,
+                      std::vector<uint8_t>& answer)
+        -> std::optional<std::vector<Waiter>>;
+    auto refused(size_t upstream) -> void;
+    auto expire(Clock::time_point now)
+        -> std::vector<std::pair<Packet, Waiter>>;
+    auto has_pending() const -> bool;
+
+   private:
+    std::unordered_map<uint16_t, PendingQuery> pending;
+    std::unordered_map<std::string, uint16_t> in_flight;
+    std::unordered_map<uint64_t, UpstreamStream> streams;
+    std::unordered_map<std::string, uint64_t> streams_in_flight;
+    uint64_t next_stream = 0;
+    std::mt19937 rng{std::random_device{}()};
+    uint64_t n_submitted = 0;
+
+    auto start(const PacketView& query, std::optional<Waiter> waiter,
+               bool& sent) -> std::optional<ErrorMessage>;
+    auto start_stream(const PacketView& query, const Waiter& waiter)
+        -> std::optional<ErrorMessage>;
+    auto close_stream(uint64_t id, UpstreamStream& entry) -> void;
+    auto allocate_id() -> std::optional<uint16_t>;
+    auto retire(std::unordered_map<uint16_t, PendingQuery>::iterator entry)
+        -> std::unordered_map<uint16_t, PendingQuery>::iterator;
+    auto select(Clock::time_point now, size_t exclude) -> size_t;
+    auto transmit(PendingQuery& entry, size_t upstream, Clock::time_point now)
+        -> std::optional<ErrorMessage>;
+};
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef IMAGE_HPP_
+#define IMAGE_HPP_
+
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "answer.hpp"
+
+namespace fs = std::filesystem;
+
+constexpr char IMAGE_MAGIC[8] = {'D', 'N', 'S', 'Z', 'I', 'M', 'G', '\0'};
+constexpr uint32_t IMAGE_VERSION = 1;
+
+// A compiled zone image starts with this header. Every offset is from the
+// start of the file and every integer is in host order: images are built
+// on the machine that serves them.
+struct ImageHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_entries;
+    uint32_t n_buckets;
+    uint32_t forward_len;
+    uint64_t size;
+    uint64_t checksum;  // FNV-1a over everything after the header
+    uint64_t buckets;
+    uint64_t entries;
+    uint64_t forward;
+};
+
+// One rendered answer, or one zone when qtype is 0. Zones are keyed by
+// their name without the trailing dot, and only carry sections when the
+// zone has an SOA to put in a not-found answer.
+struct ImageEntry {
+    uint64_t hash;
+    uint64_t name;
+    uint64_t sections;
+    uint64_t pointers;
+    uint32_t name_len;
+    uint32_t sections_len;
+    uint32_t n_pointers;
+    uint16_t qtype;
+    uint16_t flags;
+    uint16_t ancount;
+    uint16_t nscount;
+    uint16_t arcount;
+    uint16_t question_end;
+};
+
+constexpr uint16_t IMAGE_HAS_ANSWER = 1;
+constexpr uint32_t IMAGE_EMPTY_BUCKET = UINT32_MAX;
+
+// Serves answers straight out of a read-only shared mapping of a compiled
+// image, so startup only maps and checksums the file, and every server
+// process on the host shares the same page cache.
+class ZoneImage : public AnswerSource {
+   public:
+    ~ZoneImage() override;
+
+    static auto is_image(const fs::path& path) -> bool;
+    static auto open(const fs::path& path) -> std::shared_ptr<ZoneImage>;
+    static auto write(const fs::path& path, const std::string& forward_ip,
+                      const AnswerTable& table) -> bool;
+
+    auto forward_ip() const -> std::string_view;
+    auto size() const -> size_t;
+
+    auto find_zone(std::string_view qname) const
+        -> std::optional<std::string_view> override;
+    auto find(std::string_view qname, uint16_t qtype) const
+        -> std::optional<AnswerView> override;
+    auto find_missing(std::string_view domain) const
+        -> std::optional<AnswerView> override;
+
+   private:
+    const uint8_t* base = nullptr;
+    size_t length = 0;
+    const ImageHeader* header = nullptr;
+    const uint32_t* buckets = nullptr;
+    const ImageEntry* entries = nullptr;
+
+    ZoneImage() = default;
+    auto lookup(std::string_view name, uint16_t qtype) const
+        -> const ImageEntry*;
+    auto view(const ImageEntry& entry) const -> AnswerView;
+};
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef LOADER_HPP_
+#define LOADER_HPP_
+
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "record.hpp"
+#include "snapshot.hpp"
+
+namespace fs = std::filesystem;
+
+// One zone file parsed off the main thread. Problems are kept rather than
+// logged, so they are reported in config order once every zone is parsed.
+struct ZoneFile {
+    fs::path path;
+    std::string domain;
+    std::vector<Record> records;
+    std::vector<std::string> warnings;
+    std::optional<std::string> error;
+};
+
+// Reads a config file and its zone files, or a compiled zone image, into a
+// fresh snapshot. Used at startup and again on every reload, so failures
+// are logged and returned instead of ending the process.
+class ZoneLoader {
+   public:
+    fs::path path;
+    size_t n_threads = 1;
+
+    auto load() const -> std::unique_ptr<Snapshot>;
+
+   private:
+    auto load_config() const -> std::unique_ptr<Snapshot>;
+    auto load_image() const -> std::unique_ptr<Snapshot>;
+    static auto load_zone(const fs::path& zone_path) -> ZoneFile;
+};
+
+#endif
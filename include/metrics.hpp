@@ -0,0 +1,104 @@
+#ifndef METRICS_HPP_
+#define METRICS_HPP_
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+constexpr size_t TRACKED_QTYPES = 256;
+constexpr size_t RCODES = 16;
+
+// Histogram buckets are exact below 2^HISTOGRAM_SUB_BITS and then split
+// every power of two into 2^HISTOGRAM_SUB_BITS linear steps, so any value
+// is off by at most 1/16 of itself, as in an HDR histogram with one
+// significant digit.
+constexpr unsigned HISTOGRAM_SUB_BITS = 4;
+constexpr size_t HISTOGRAM_BUCKETS = (64 - HISTOGRAM_SUB_BITS + 1)
+                                     << HISTOGRAM_SUB_BITS;
+
+// A counter with a single writer. Bumping it is a plain load and store,
+// not a locked read-modify-write, and readers on other threads still see
+// a whole value.
+class Counter {
+   public:
+    auto add(uint64_t n = 1) -> void {
+        this->value.store(this->value.load(std::memory_order_relaxed) + n,
+                          std::memory_order_relaxed);
+    }
+    auto load() const -> uint64_t {
+        return this->value.load(std::memory_order_relaxed);
+    }
+
+   private:
+    std::atomic<uint64_t> value{0};
+};
+
+// Log-linear latency histogram in nanoseconds, written by one thread.
+class Histogram {
+   public:
+    auto record(std::chrono::nanoseconds elapsed) -> void;
+    auto merge_into(std::vector<uint64_t>& totals) const -> void;
+
+    static auto bucket_of(uint64_t value) -> size_t;
+    static auto upper_bound(size_t bucket) -> uint64_t;
+    static auto summarize(const std::vector<uint64_t>& totals) -> std::string;
+
+   private:
+    std::array<Counter, HISTOGRAM_BUCKETS> buckets;
+};
+
+enum class Drop {
+    Malformed,
+    ForwardFailed,
+    SendFailed,
+};
+
+// Everything one worker counts. Only that worker writes it; the stats
+// reader sums the workers at the moment it is asked.
+struct alignas(64) WorkerMetrics {
+    std::array<Counter, TRACKED_QTYPES + 1> qtypes;
+    std::array<Counter, RCODES> rcodes;
+    Counter authoritative;
+    Counter forwarded;
+    Counter cache_hits;
+    Counter cache_misses;
+    Counter prefetches;
+    Counter upstream_timeouts;
+    Counter upstream_retries;
+    Counter coalesced;
+    Counter truncated;
+    Counter rate_limited;
+    Counter slipped;
+    std::array<Counter, 3> drops;
+    Histogram latency;
+    Histogram upstream_rtt;
+
+    auto query(uint16_t qtype) -> void {
+        this->qtypes[std::min<size_t>(qtype, TRACKED_QTYPES)].add();
+    }
+    auto drop(Drop reason) -> void {
+        this->drops[static_cast<size_t>(reason)].add();
+    }
+};
+
+// Serves a plain-text report of the summed worker metrics to every client
+// that connects to a Unix socket at `path`.
+class StatsListener {
+   public:
+    StatsListener(std::string path,
+                  std::vector<std::shared_ptr<WorkerMetrics>> workers);
+
+    auto run() -> void;
+    auto report() const -> std::string;
+
+   private:
+    std::string path;
+    std::vector<std::shared_ptr<WorkerMetrics>> workers;
+};
+
+#endif
@@ -3,10 +3,22 @@
 
 #include <cinttypes>
 #include <memory>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
 
-constexpr int PACKET_SIZE = 1024;
+// The largest UDP message received or sent. Each reply is further capped
+// at the payload size its client advertises (RFC 6891), or at 512 bytes
+// for clients without EDNS.
+constexpr int PACKET_SIZE = 4096;
+constexpr size_t MIN_UDP_SIZE = 512;
+constexpr size_t DEFAULT_EDNS_SIZE = 1232;
+constexpr size_t MAX_NAME_SIZE = 255;
+
+constexpr uint16_t OPT_TYPE = 41;
+constexpr size_t OPT_SIZE = 11;
+constexpr uint8_t EDNS_BADVERS = 1;
 
 struct Header {
     uint16_t dns_id;
@@ -36,7 +48,7 @@ struct Header {
     uint16_t dns_nscount;
     uint16_t dns_arcount;
 
-    static auto from_network(void* data) -> Header;
+    static auto from_network(const void* data) -> Header;
     static auto to_response(const Header& header) -> Header;
 } __attribute__((packed));
 
@@ -46,7 +58,7 @@ class Packet {
     std::unique_ptr<uint8_t[]> payload;
     size_t plen;
 
-    static auto from_binary(void* data, size_t nbytes) -> Packet;
+    static auto from_binary(const void* data, size_t nbytes) -> Packet;
     auto raw() const -> std::unique_ptr<uint8_t[]>;
     auto raw_size() const -> size_t;
 };
@@ -63,4 +75,42 @@ struct Query {
     auto raw_size() const -> size_t;
 };
 
+// A query parsed in place from the buffer it was received into. The header
+// is copied out in host order and the question name is decoded into a
+// fixed buffer, so parsing never touches the heap.
+class PacketView {
+   public:
+    Header header;
+    const uint8_t* data;
+    size_t len;
+    size_t question_end;
+    uint16_t qtype;
+    uint16_t qclass;
+
+    // Set from the OPT record in the additional section, if any.
+    bool edns;
+    uint8_t edns_version;
+    uint16_t edns_size;
+
+    static auto parse(const uint8_t* data, size_t len)
+        -> std::optional<PacketView>;
+    auto qname() const -> std::string_view;
+    auto payload_limit(size_t server_size) const -> size_t;
+
+   private:
+    char name[MAX_NAME_SIZE + 1];
+    size_t name_len;
+};
+
+// Writes a reply to `query` that carries only its question: the TC reply
+// for an answer that does not fit, or the body of an error with `rcode`.
+auto write_question_only(const PacketView& query, bool truncated,
+                         uint8_t* out, size_t size, uint8_t rcode = 0)
+    -> size_t;
+
+// Appends an OPT record advertising `udp_size` to the reply of `len` bytes
+// in `out` and counts it in the header. Returns 0 if it does not fit.
+auto append_opt(uint8_t* out, size_t len, size_t size, uint16_t udp_size,
+                uint8_t ext_rcode = 0) -> size_t;
+
 #endif  // PACKET_HPP_
\ No newline at end of file
@@ -0,0 +1,57 @@
+#ifndef RATELIMIT_HPP_
+#define RATELIMIT_HPP_
+
+#include <arpa/inet.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+
+#include "forwarder.hpp"
+
+constexpr size_t DEFAULT_RRL_BUCKETS = 1 << 16;
+constexpr size_t DEFAULT_RRL_SLIP = 2;
+
+// Clients are limited by /24, as BIND does by default, so an attacker can't
+// dodge the limit by spreading over neighbouring addresses.
+constexpr in_addr_t RRL_PREFIX_MASK = 0xffffff00;
+
+// What a response is, for rate limiting; each class has its own bucket.
+enum class ResponseClass : uint8_t {
+    Answer,
+    NotFound,
+    Forwarded,
+    Error,
+};
+
+// Response rate limiting in the spirit of BIND RRL. Each (client prefix,
+// response class) has a token bucket refilled at `rate` responses a second
+// that holds at most one second's worth.
+//
+// The buckets live in a fixed table of 64-bit words, each packing a tag of
+// its key, the tokens left and when it was last refilled, and every check
+// is one load and one compare-and-swap, so all workers share the table
+// without locks. A key that lands on a slot tagged for another takes it
+// over with a full bucket, which errs toward answering.
+class RateLimiter {
+   public:
+    RateLimiter(size_t rate, size_t slip, size_t buckets);
+
+    // Takes a token for the response, or returns false when it is over the
+    // limit. Expects `addr` in network order.
+    auto allow(in_addr_t addr, ResponseClass response, Clock::time_point now)
+        -> bool;
+
+    // Every slip-th limited response is still sent, truncated, so genuine
+    // clients retry over TCP; 0 drops them all.
+    size_t slip;
+
+   private:
+    uint32_t rate;
+    uint32_t burst;
+    size_t mask;
+    std::unique_ptr<std::atomic<uint64_t>[]> table;
+};
+
+#endif
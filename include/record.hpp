@@ -1,9 +1,49 @@
 #ifndef RECORD_HPP_
 #define RECORD_HPP_
 
+#include <netinet/in.h>
+
 #include <string>
+#include <variant>
 #include <vector>
 
+// Rdata is parsed once when the zone is loaded. Addresses and integers are
+// kept in network byte order, ready to be copied onto the wire; names stay
+// dotted so the response writer can compress them.
+struct AData {
+    in_addr address;
+};
+
+struct AAAAData {
+    in6_addr address;
+};
+
+struct NameData {
+    std::string name;
+};
+
+struct MXData {
+    uint16_t preference;
+    std::string exchange;
+};
+
+struct SOAData {
+    std::string mname;
+    std::string rname;
+    uint32_t serial;
+    uint32_t refresh;
+    uint32_t retry;
+    uint32_t expire;
+    uint32_t minimum;
+};
+
+struct TXTData {
+    std::string text;
+};
+
+using RData =
+    std::variant<AData, AAAAData, NameData, MXData, SOAData, TXTData>;
+
 class Record {
    public:
     enum Type {
@@ -22,7 +62,7 @@ class Record {
     uint16_t r_class;
     uint32_t r_ttl;
     uint16_t r_rdlength;
-    std::vector<std::string> r_rdata;
+    RData r_rdata;
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -2,39 +2,136 @@
 #define DNS_SERVER_HPP_
 
 #include <arpa/inet.h>
+#include <sys/socket.h>
 
+#include <array>
+#include <chrono>
 #include <filesystem>
 #include <map>
 #include <optional>
 #include <string>
 #include <vector>
 
+#include "answer.hpp"
+#include "cache.hpp"
 #include "collection.hpp"
+#include "forwarder.hpp"
+#include "metrics.hpp"
 #include "packet.hpp"
+#include "ratelimit.hpp"
 #include "record.hpp"
+#include "snapshot.hpp"
 #include "strategy.hpp"
+#include "stream.hpp"
+#include "update.hpp"
+#include "uring.hpp"
 
-using ErrorMessage = std::string;
 namespace fs = std::filesystem;
 constexpr int FORWARD_PORT = 53;
+constexpr size_t DEFAULT_BATCH_SIZE = 32;
+constexpr auto STATS_INTERVAL = std::chrono::seconds(10);
+constexpr int POLL_TIMEOUT_MS = 100;
+constexpr int MAX_EVENTS = 64;
+
+// Ring tags; the two datagram sockets use theirs as buffer groups too.
+constexpr uint16_t RING_CLIENT = 0;
+constexpr uint16_t RING_FORWARD = 1;
+constexpr uint64_t RING_STREAMS = 2;
+
+// Forward receives carry the upstream's index above this shift in the tag.
+constexpr unsigned RING_UPSTREAM_SHIFT = 16;
+
+// How workers wait for datagrams: epoll with recvfrom/recvmmsg, or an
+// io_uring per worker. Uring falls back to Syscall where it is missing or
+// a receive on it fails for good.
+enum class Backend { Syscall, Uring };
+
+// Every worker thread owns a client socket from the same SO_REUSEPORT group,
+// so the kernel spreads queries across workers, and a private forwarder
+// so upstream replies always come back to the worker that asked. TCP
+// listeners share the port the same way, and each worker's epoll set holds
+// its sockets and the connections it accepted.
+struct Worker {
+    size_t id;
+    int client_sock;
+    int epoll_fd = -1;
+    Forwarder forwarder;
+    StreamTable streams;
+    IoRing* ring = nullptr;
+    std::shared_ptr<UpdateReplies> update_replies =
+        std::make_shared<UpdateReplies>();
+    uint64_t limited = 0;
+    std::shared_ptr<WorkerMetrics> metrics = std::make_shared<WorkerMetrics>();
+};
+
+// How full recvmmsg batches are; reported every STATS_INTERVAL.
+struct BatchStats {
+    uint64_t batches;
+    uint64_t packets;
+};
+
+// Scratch space for one recvmmsg/sendmmsg round, reused across rounds.
+struct Batch {
+    explicit Batch(size_t size);
+
+    std::vector<std::array<uint8_t, PACKET_SIZE>> bufs;
+    std::vector<sockaddr_in> senders;
+    std::vector<iovec> recv_iovs;
+    std::vector<mmsghdr> recv_msgs;
+
+    std::vector<std::array<uint8_t, PACKET_SIZE>> replies;
+    std::vector<iovec> send_iovs;
+    std::vector<mmsghdr> send_msgs;
+
+    BatchStats stats{};
+    Clock::time_point last_report = Clock::now();
+};
 
 class Server {
     friend class ServerBuilder;
 
    public:
-    int client_sock, forward_sock;
-    sockaddr_in forward_sin{};
-    Collection collection;
+    std::vector<Worker> workers;
+    std::shared_ptr<SnapshotRcu> snapshots;
+    std::shared_ptr<Updater> updater;
+    size_t batch_size = DEFAULT_BATCH_SIZE;
+    size_t edns_size = DEFAULT_EDNS_SIZE;
+    Backend backend = Backend::Syscall;
+    std::shared_ptr<ResponseCache> cache;
+    std::shared_ptr<RateLimiter> rate_limiter;
+    std::shared_ptr<StatsListener> stats;
 
     auto run() -> void;
 
    private:
     std::map<Record::Type, std::shared_ptr<QueryResponder>> registered_handler;
 
-    auto forward(const Packet& packet) -> std::optional<Packet>;
-    auto send(int sock_fd, const std::unique_ptr<uint8_t[]>& pkt, size_t nbytes,
-              sockaddr_in sin) -> std::optional<ErrorMessage>;
-    auto receive(int sock_fd) -> std::optional<std::pair<Packet, sockaddr_in>>;
+    auto serve(Worker& worker) -> void;
+    auto serve_ring(Worker& worker, IoRing& ring) -> void;
+    auto watch(Worker& worker, bool datagrams) -> void;
+    auto maintain(Worker& worker, Clock::time_point& last_sweep) -> void;
+    auto serve_event(Worker& worker, uint64_t id, uint32_t events) -> void;
+    auto serve_stream(Worker& worker, uint64_t id, uint32_t events) -> void;
+    auto answer_updates(Worker& worker) -> void;
+    auto wait_reload() -> void;
+    auto answer_one(Worker& worker) -> void;
+    auto answer_batch(Worker& worker, Batch& batch) -> void;
+    auto relay(Worker& worker, size_t upstream) -> void;
+    auto deliver(Worker& worker, const std::vector<Waiter>& waiters,
+                 uint8_t* pkt, size_t nbytes) -> void;
+    auto handle(Worker& worker, const PacketView& query, const Client& client,
+                uint8_t* out, size_t size) -> size_t;
+    auto answer(Worker& worker, const PacketView& query, const Client& client,
+                uint8_t* out, size_t size) -> size_t;
+    auto resolve(Worker& worker, const PacketView& query, const Client& client,
+                 uint8_t* out, size_t size) -> size_t;
+    auto limit(Worker& worker, const PacketView& query, const Client& client,
+               ResponseClass response, uint8_t* out, size_t size)
+        -> std::optional<size_t>;
+    auto reply(Worker& worker, const Client& client, const uint8_t* pkt,
+               size_t nbytes) -> std::optional<ErrorMessage>;
+    auto send(int sock_fd, const uint8_t* pkt, size_t nbytes,
+              const sockaddr_in& sin) -> std::optional<ErrorMessage>;
 };
 
-#endif
\ No newline at end of file
+#endif
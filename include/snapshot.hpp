@@ -0,0 +1,64 @@
+#ifndef SNAPSHOT_HPP_
+#define SNAPSHOT_HPP_
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "answer.hpp"
+#include "collection.hpp"
+#include "strategy.hpp"
+
+// Everything queries are answered from. A snapshot is never modified once
+// published; a reload or an update builds a new one and swaps it in. The
+// collection is null when the answers are mapped from a compiled image.
+struct Snapshot {
+    std::string forward_ip;
+    std::shared_ptr<const Collection> collection;
+    std::shared_ptr<const AnswerSource> answers;
+
+    // Renders the answers from the collection, unless they were mapped from
+    // a compiled image.
+    auto render(const std::map<Record::Type, std::shared_ptr<QueryResponder>>&
+                    handlers) -> void;
+};
+
+// Hands the current snapshot to the workers without any lock on their side
+// (quiescent-state RCU). Each worker calls quiesce() between poll rounds,
+// where it holds no pointer into a snapshot. A replaced snapshot is retired
+// and freed by a later reclaim() once every worker has passed such a point,
+// so publishing never waits for the workers.
+class SnapshotRcu {
+   public:
+    explicit SnapshotRcu(size_t n_readers);
+
+    auto current() const -> const Snapshot*;
+    auto quiesce(size_t reader) -> void;
+    auto publish(std::unique_ptr<Snapshot> next) -> void;
+    auto reclaim() -> void;
+
+   private:
+    // One cache line per reader, so quiescing never bounces a line shared
+    // with another worker.
+    struct alignas(64) Reader {
+        std::atomic<uint64_t> seen{0};
+    };
+
+    struct Retired {
+        uint64_t generation;
+        std::unique_ptr<const Snapshot> snapshot;
+    };
+
+    std::atomic<const Snapshot*> snapshot{nullptr};
+    std::atomic<uint64_t> generation{0};
+    std::unique_ptr<Reader[]> readers;
+    size_t n_readers;
+    std::mutex publishing;
+    std::unique_ptr<const Snapshot> owned;
+    std::vector<Retired> retired;
+};
+
+#endif
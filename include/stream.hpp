@@ -0,0 +1,65 @@
+#ifndef STREAM_HPP_
+#define STREAM_HPP_
+
+#include <arpa/inet.h>
+
+#include <chrono>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "forwarder.hpp"
+
+constexpr size_t DEFAULT_TCP_CONNECTIONS = 1024;
+constexpr size_t TCP_MAX_MESSAGE = UINT16_MAX;
+constexpr size_t TCP_MAX_OUTPUT = 256 << 10;
+constexpr int TCP_BACKLOG = 128;
+constexpr auto TCP_IDLE_TIMEOUT = std::chrono::seconds(10);
+constexpr auto TCP_SWEEP_INTERVAL = std::chrono::seconds(1);
+
+// epoll ids below FIRST_STREAM_ID name the worker's own sockets and its
+// update replies; the socket for upstream i is EPOLL_FORWARD + i.
+constexpr uint64_t EPOLL_UDP = 0;
+constexpr uint64_t EPOLL_LISTEN = 1;
+constexpr uint64_t EPOLL_UPDATES = 2;
+constexpr uint64_t EPOLL_FORWARD = 3;
+constexpr uint64_t FIRST_STREAM_ID = EPOLL_FORWARD + MAX_UPSTREAMS;
+
+// One client connection carrying length-prefixed messages (RFC 7766).
+// `in` holds bytes not yet framed; `out` holds framed replies from `sent`
+// on that the socket has not taken yet.
+struct Connection {
+    int fd;
+    sockaddr_in peer;
+    std::vector<uint8_t> in;
+    std::vector<uint8_t> out;
+    size_t sent = 0;
+    Clock::time_point last_active;
+    bool eof = false;
+    bool want_read = true;
+    bool want_write = false;
+};
+
+// The TCP side of one worker, driven by the worker's epoll set.
+// Connections are keyed by an id that is never reused, so an upstream
+// answer for a closed connection is dropped rather than delivered to a
+// newer connection on the same descriptor.
+class StreamTable {
+   public:
+    int listen_sock = -1;
+    size_t max_connections = DEFAULT_TCP_CONNECTIONS;
+
+    auto accept(int epoll_fd) -> void;
+    auto find(uint64_t id) -> Connection*;
+    auto read(Connection& conn) -> bool;
+    auto queue(Connection& conn, const uint8_t* msg, size_t len) -> bool;
+    auto flush(int epoll_fd, uint64_t id, Connection& conn) -> bool;
+    auto close(int epoll_fd, uint64_t id) -> void;
+    auto sweep(int epoll_fd, Clock::time_point now) -> void;
+
+   private:
+    std::unordered_map<uint64_t, Connection> connections;
+    uint64_t next_id = FIRST_STREAM_ID;
+};
+
+#endif
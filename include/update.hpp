@@ -0,0 +1,120 @@
+#ifndef UPDATE_HPP_
+#define UPDATE_HPP_
+
+#include <arpa/inet.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "answer.hpp"
+#include "collection.hpp"
+#include "loader.hpp"
+#include "packet.hpp"
+#include "snapshot.hpp"
+#include "strategy.hpp"
+
+constexpr uint8_t OPCODE_UPDATE = 5;
+constexpr size_t MAX_PENDING_UPDATES = 4096;
+constexpr size_t COMPACT_THRESHOLD = 4096;
+constexpr auto RECLAIM_INTERVAL = std::chrono::milliseconds(100);
+constexpr auto UPDATE_REPORT_INTERVAL = std::chrono::seconds(10);
+
+// Response codes of RFC 1035 and RFC 2136.
+enum Rcode : uint8_t {
+    NOERROR = 0,
+    FORMERR = 1,
+    SERVFAIL = 2,
+    NXDOMAIN = 3,
+    NOTIMP = 4,
+    REFUSED = 5,
+    YXDOMAIN = 6,
+    YXRRSET = 7,
+    NXRRSET = 8,
+    NOTAUTH = 9,
+    NOTZONE = 10,
+};
+
+// Replies to UPDATEs that came over TCP, on their way from the updater
+// back to the worker that owns the connection. Posting one wakes the
+// worker through `event`, an eventfd on its epoll set.
+class UpdateReplies {
+   public:
+    int event = -1;
+
+    auto post(uint64_t stream, std::vector<uint8_t> reply) -> void;
+    auto take() -> std::vector<std::pair<uint64_t, std::vector<uint8_t>>>;
+
+   private:
+    std::mutex lock;
+    std::vector<std::pair<uint64_t, std::vector<uint8_t>>> replies;
+};
+
+// Where an UPDATE's reply goes: out of `sock` to `client`, or, when
+// `stream` is not 0, into that TCP connection through `replies`.
+struct UpdateOrigin {
+    sockaddr_in client;
+    int sock;
+    uint64_t stream = 0;
+    std::shared_ptr<UpdateReplies> replies;
+};
+
+// An UPDATE message copied off a worker, answered once it is applied.
+struct UpdateRequest {
+    std::vector<uint8_t> message;
+    UpdateOrigin origin;
+};
+
+// The collection and answers of the next snapshot while updates apply.
+// Both are copy-on-write layers over the published base, so a batch only
+// copies the RRsets and answers it touches.
+struct UpdateDraft {
+    std::shared_ptr<Collection> collection;
+    std::shared_ptr<AnswerTable> answers;
+};
+
+// The only writer of the published snapshot. Workers hand RFC 2136 UPDATE
+// messages and reload requests to it. It applies each queued batch to one
+// draft and publishes that draft before replying, and it frees retired
+// snapshots between batches.
+class Updater {
+   public:
+    Updater(std::shared_ptr<SnapshotRcu> snapshots, ZoneLoader loader,
+            std::map<Record::Type, std::shared_ptr<QueryResponder>> handlers,
+            std::vector<in_addr_t> allowed);
+
+    static auto reply(const PacketView& message, uint8_t rcode, uint8_t* out,
+                      size_t size) -> size_t;
+    auto submit(const PacketView& message, const UpdateOrigin& origin,
+                uint8_t* out, size_t size) -> size_t;
+    auto request_reload() -> void;
+    auto run() -> void;
+
+   private:
+    std::shared_ptr<SnapshotRcu> snapshots;
+    ZoneLoader loader;
+    std::map<Record::Type, std::shared_ptr<QueryResponder>> handlers;
+    std::vector<in_addr_t> allowed;
+
+    std::mutex lock;
+    std::condition_variable wakeup;
+    std::vector<UpdateRequest> pending;
+    bool reload_pending = false;
+
+    uint64_t n_applied = 0;
+    uint64_t n_rejected = 0;
+    uint64_t n_batches = 0;
+
+    auto reload() -> void;
+    auto apply_batch(std::vector<UpdateRequest>& batch) -> void;
+    auto apply(UpdateDraft& draft, const PacketView& message) -> uint8_t;
+    auto rerender(UpdateDraft& draft, const std::string& zone,
+                  const std::vector<std::pair<std::string, uint16_t>>& touched)
+        -> void;
+};
+
+#endif
@@ -0,0 +1,138 @@
+#ifndef URING_HPP_
+#define URING_HPP_
+
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include "packet.hpp"
+
+constexpr unsigned RING_ENTRIES = 256;
+constexpr unsigned RING_BUFFERS = 256;
+constexpr unsigned RING_SEND_SLOTS = 256;
+constexpr uint16_t RING_GROUPS = 2;
+
+// Completion tags with this bit set belong to the ring's own sends.
+constexpr uint64_t RING_SEND_TAG = 1ULL << 63;
+
+// One completion, with the provided buffer it filled if it has one.
+struct RingCompletion {
+    uint64_t tag;
+    int32_t res;
+    uint32_t flags;
+
+    auto more() const -> bool { return this->flags & IORING_CQE_F_MORE; }
+    auto has_buffer() const -> bool {
+        return this->flags & IORING_CQE_F_BUFFER;
+    }
+    auto buffer_id() const -> uint16_t {
+        return this->flags >> IORING_CQE_BUFFER_SHIFT;
+    }
+};
+
+// A datagram received by a multishot recvmsg, in place in its buffer.
+struct RingMessage {
+    sockaddr_in from;
+    uint8_t* data;
+    size_t len;
+};
+
+// A minimal io_uring driven through the raw system calls, as one worker
+// needs it: multishot receives into a ring of provided buffers registered
+// with the kernel, a multishot poll, and sends from a fixed pool of slots
+// that are all submitted with the next wait. Sends complete inside the
+// ring; every other completion is handed to the caller. Not thread-safe.
+class IoRing {
+   public:
+    static auto create(unsigned entries) -> std::unique_ptr<IoRing>;
+    ~IoRing();
+
+    IoRing(const IoRing&) = delete;
+    auto operator=(const IoRing&) -> IoRing& = delete;
+
+    auto provide_buffers(uint16_t group, unsigned count) -> bool;
+    auto recv_multishot(int fd, uint16_t group, uint64_t tag) -> void;
+    auto poll_multishot(int fd, uint64_t tag) -> void;
+    auto send(int fd, const uint8_t* data, size_t len, const sockaddr_in& to)
+        -> bool;
+
+    auto wait(std::chrono::milliseconds timeout) -> void;
+    auto message(uint16_t group, const RingCompletion& completion)
+        -> std::optional<RingMessage>;
+    auto recycle(uint16_t group, uint16_t buffer_id) -> void;
+
+    template <typename Fn>
+    auto for_each_completion(Fn&& fn) -> void;
+
+   private:
+    struct BufferGroup {
+        io_uring_buf_ring* ring = nullptr;
+        std::unique_ptr<uint8_t[]> buffers;
+        unsigned count = 0;
+        msghdr header{};
+    };
+
+    struct SendSlot {
+        uint8_t data[PACKET_SIZE];
+        sockaddr_in to;
+        iovec iov;
+        msghdr header;
+    };
+
+    int fd = -1;
+    void* sq_map = nullptr;
+    size_t sq_map_len = 0;
+    void* cq_map = nullptr;
+    size_t cq_map_len = 0;
+    io_uring_sqe* sqes = nullptr;
+    size_t sqes_len = 0;
+
+    unsigned sq_entries;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    io_uring_cqe* cqes;
+    unsigned to_submit = 0;
+
+    std::array<BufferGroup, RING_GROUPS> groups;
+    std::vector<SendSlot> slots;
+    std::vector<uint32_t> free_slots;
+
+    IoRing() = default;
+    auto next_sqe() -> io_uring_sqe*;
+    auto enter(unsigned min_complete, unsigned flags, const void* arg,
+               size_t arg_size) -> int;
+    auto complete_send(const RingCompletion& completion) -> void;
+};
+
+template <typename Fn>
+auto IoRing::for_each_completion(Fn&& fn) -> void {
+    unsigned head = *this->cq_head;
+    unsigned tail = __atomic_load_n(this->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+        const io_uring_cqe& cqe = this->cqes[head & *this->cq_mask];
+        RingCompletion completion{cqe.user_data, cqe.res, cqe.flags};
+
+        if (completion.tag & RING_SEND_TAG) {
+            this->complete_send(completion);
+        } else {
+            fn(completion);
+        }
+    }
+
+    __atomic_store_n(this->cq_head, head, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -18,6 +18,8 @@ inline auto err_quit(const std::string& m) -> void {
 
 auto parse_args(int argc, char* argv[]) -> std::pair<uint16_t, fs::path>;
 
+auto env_or(const char* name, size_t fallback) -> size_t;
+
 auto trim(const std::string& str, TrimStrategy strategy = std::not_fn(isspace))
     -> std::string;
 
@@ -0,0 +1,344 @@
+#include "answer.hpp"
+
+#include <arpa/inet.h>
+
+#include <functional>
+
+#include "builder.hpp"
+#include "spdlog/spdlog.h"
+
+// Collects the position of every compression pointer in `count` records
+// starting at `cursor`. Names only occur in the owner field and in the rdata
+// of the types below.
+static auto find_pointers(const uint8_t* data, size_t len, size_t cursor,
+                          size_t count) -> std::vector<uint16_t> {
+    std::vector<uint16_t> pointers;
+
+    auto skip_name = [&](size_t at) {
+        while (at < len) {
+            if ((data[at] & 0xc0) == 0xc0) {
+                pointers.push_back(at);
+                return at + 2;
+            }
+            if (data[at] == 0) {
+                return at + 1;
+            }
+            at += data[at] + 1;
+        }
+        return at;
+    };
+
+    for (size_t i = 0; i < count && cursor < len; i++) {
+        cursor = skip_name(cursor);
+
+        uint16_t type, rdlength;
+        std::copy_n(data + cursor, sizeof(type),
+                    reinterpret_cast<uint8_t*>(&type));
+        std::copy_n(data + cursor + 8, sizeof(rdlength),
+                    reinterpret_cast<uint8_t*>(&rdlength));
+        cursor += sizeof(RecordParmas);
+        size_t next = cursor + ntohs(rdlength);
+
+        switch (ntohs(type)) {
+            case Record::NS:
+            case Record::CNAME:
+                skip_name(cursor);
+                break;
+            case Record::MX:
+                skip_name(cursor + sizeof(uint16_t));
+                break;
+            case Record::SOA:
+                skip_name(skip_name(cursor));
+                break;
+        }
+        cursor = next;
+    }
+
+    return pointers;
+}
+
+// Runs `responder` on a synthetic query and keeps what follows the question.
+static auto render_one(const Collection& collection, QueryResponder& responder,
+                       const std::string& qname, uint16_t qtype)
+    -> std::optional<Answer> {
+    Query query{qname, qtype, Record::IN};
+    auto query_raw = query.raw();
+
+    Header header{};
+    header.dns_qdcount = htons(1);
+
+    uint8_t buf[PACKET_SIZE];
+    std::copy_n(reinterpret_cast<uint8_t*>(&header), sizeof(header), buf);
+    std::copy_n(query_raw.get(), query.raw_size(), buf + sizeof(header));
+    auto packet = Packet::from_binary(buf, sizeof(header) + query.raw_size());
+
+    auto response = responder.response(collection, packet);
+    if (!response) {
+        return {};
+    }
+
+    auto raw = response->raw();
+    size_t question_end = sizeof(Header) + query.raw_size();
+    uint16_t ancount = ntohs(response->header.dns_ancount);
+    uint16_t nscount = ntohs(response->header.dns_nscount);
+    uint16_t arcount = ntohs(response->header.dns_arcount);
+
+    auto pointers = find_pointers(raw.get(), response->raw_size(),
+                                  question_end, ancount + nscount + arcount);
+    for (auto& pointer : pointers) {
+        pointer -= question_end;
+    }
+
+    return Answer{
+        .owner = qname,
+        .qtype = qtype,
+        .ancount = ancount,
+        .nscount = nscount,
+        .arcount = arcount,
+        .question_end = question_end,
+        .sections = std::vector<uint8_t>(raw.get() + question_end,
+                                         raw.get() + response->raw_size()),
+        .pointers = std::move(pointers),
+    };
+}
+
+static auto answer_hash(std::string_view owner, uint16_t qtype) -> size_t {
+    return std::hash<std::string_view>{}(owner) ^
+           (static_cast<size_t>(qtype) * 0x9e3779b97f4a7c15ULL);
+}
+
+auto Answer::view() const -> AnswerView {
+    return AnswerView{
+        .ancount = this->ancount,
+        .nscount = this->nscount,
+        .arcount = this->arcount,
+        .question_end = this->question_end,
+        .sections = this->sections.data(),
+        .sections_len = this->sections.size(),
+        .pointers = this->pointers.data(),
+        .n_pointers = this->pointers.size(),
+    };
+}
+
+auto AnswerView::write(const PacketView& query, uint8_t* out,
+                       size_t size) const -> size_t {
+    size_t total = query.question_end + this->sections_len;
+    if (total > size || query.question_end < this->question_end) {
+        return 0;
+    }
+
+    Header header = query.header;
+    header.dns_qr = 1;
+    header.dns_ancount = this->ancount;
+    header.dns_nscount = this->nscount;
+    header.dns_arcount = this->arcount;
+    header = Header::to_response(header);
+
+    uint8_t* cursor = out;
+    cursor = std::copy_n(reinterpret_cast<uint8_t*>(&header), sizeof(header),
+                         cursor);
+    cursor = std::copy(query.data + sizeof(header),
+                       query.data + query.question_end, cursor);
+    std::copy_n(this->sections, this->sections_len, cursor);
+
+    // The question only grows by labels in front of the rendered name, so
+    // every pointer target moves by the same amount.
+    size_t shift = query.question_end - this->question_end;
+    if (shift == 0) {
+        return total;
+    }
+
+    for (size_t i = 0; i < this->n_pointers; i++) {
+        uint8_t* at = cursor + this->pointers[i];
+        uint16_t offset = ((at[0] & 0x3f) << 8 | at[1]) + shift;
+        at[0] = 0xc0 | (offset >> 8);
+        at[1] = offset & 0xff;
+    }
+
+    return total;
+}
+
+auto AnswerTable::render(
+    const Collection& collection,
+    const std::map<Record::Type, std::shared_ptr<QueryResponder>>& handlers)
+    -> void {
+    NotFoundResponder not_found;
+
+    this->zones = collection.zones;
+    this->zone_names = collection.domains;
+
+    for (const auto& domain : collection.domains) {
+        auto missing = render_one(collection, not_found, domain, Record::SOA);
+        if (missing) {
+            missing->qtype = 0;
+            this->add(this->missing, std::move(*missing));
+        }
+    }
+
+    for (const auto& rrset : collection.rrsets) {
+        if (rrset.r_class != Record::IN) {
+            continue;
+        }
+
+        auto handler = handlers.find(static_cast<Record::Type>(rrset.r_type));
+        if (handler == handlers.end()) {
+            spdlog::warn("No responder for type {}", rrset.r_type);
+            continue;
+        }
+
+        auto answer = render_one(collection, *handler->second, rrset.owner,
+                                 rrset.r_type);
+        if (!answer) {
+            spdlog::warn("Fail to render {} type {}", rrset.owner,
+                         rrset.r_type);
+            continue;
+        }
+        this->add(this->index, std::move(*answer));
+    }
+
+    spdlog::info("Rendered {} answers", this->index.size());
+}
+
+auto AnswerTable::rerender(
+    const Collection& collection,
+    const std::map<Record::Type, std::shared_ptr<QueryResponder>>& handlers,
+    const std::string& owner, uint16_t qtype) -> void {
+    std::optional<Answer> answer;
+
+    if (!collection.search_records(owner, qtype, Record::IN).empty()) {
+        auto handler = handlers.find(static_cast<Record::Type>(qtype));
+        if (handler != handlers.end()) {
+            answer = render_one(collection, *handler->second, owner, qtype);
+        }
+        if (!answer) {
+            spdlog::warn("Fail to render {} type {}", owner, qtype);
+        }
+    }
+
+    if (!answer) {
+        answer = Answer{.owner = owner, .qtype = qtype, .removed = true};
+    }
+    this->add(this->index, std::move(*answer));
+}
+
+auto AnswerTable::rerender_missing(const Collection& collection,
+                                   const std::string& domain) -> void {
+    NotFoundResponder not_found;
+
+    auto answer = render_one(collection, not_found, domain, Record::SOA);
+    if (!answer) {
+        answer = Answer{.owner = domain, .removed = true};
+    }
+    answer->qtype = 0;
+    this->add(this->missing, std::move(*answer));
+}
+
+auto AnswerTable::flatten() const -> AnswerTable {
+    if (!this->base) {
+        return *this;
+    }
+
+    AnswerTable flat;
+    flat.zones = this->base->zones;
+    flat.zone_names = this->base->zone_names;
+
+    for (const auto& answer : this->base->answers) {
+        if (this->lookup(this->table_of(answer.qtype), answer.owner,
+                         answer.qtype) == nullptr) {
+            auto& table = answer.qtype == 0 ? flat.missing : flat.index;
+            flat.add(table, answer);
+        }
+    }
+
+    for (const auto& answer : this->answers) {
+        if (!answer.removed) {
+            auto& table = answer.qtype == 0 ? flat.missing : flat.index;
+            flat.add(table, answer);
+        }
+    }
+
+    return flat;
+}
+
+auto AnswerTable::find_zone(std::string_view qname) const
+    -> std::optional<std::string_view> {
+    if (this->base) {
+        return this->base->find_zone(qname);
+    }
+
+    const std::string* zone = this->zones.find(qname);
+    if (zone == nullptr) {
+        return {};
+    }
+    return *zone;
+}
+
+auto AnswerTable::find(std::string_view qname, uint16_t qtype) const
+    -> std::optional<AnswerView> {
+    auto answer = this->lookup(this->index, qname, qtype);
+    if (answer == nullptr) {
+        return this->base ? this->base->find(qname, qtype)
+                          : std::optional<AnswerView>();
+    }
+    if (answer->removed) {
+        return {};
+    }
+    return answer->view();
+}
+
+auto AnswerTable::find_missing(std::string_view domain) const
+    -> std::optional<AnswerView> {
+    auto answer = this->lookup(this->missing, domain, 0);
+    if (answer == nullptr) {
+        return this->base ? this->base->find_missing(domain)
+                          : std::optional<AnswerView>();
+    }
+    if (answer->removed) {
+        return {};
+    }
+    return answer->view();
+}
+
+auto AnswerTable::domains() const -> const std::vector<std::string>& {
+    return this->zone_names;
+}
+
+auto AnswerTable::entries() const -> const std::vector<Answer>& {
+    return this->answers;
+}
+
+auto AnswerTable::add(std::unordered_multimap<size_t, uint32_t>& table,
+                      Answer answer) -> void {
+    size_t hash = answer_hash(answer.owner, answer.qtype);
+    auto [first, last] = table.equal_range(hash);
+
+    for (auto it = first; it != last; it++) {
+        auto& known = this->answers[it->second];
+        if (known.qtype == answer.qtype && known.owner == answer.owner) {
+            known = std::move(answer);
+            return;
+        }
+    }
+
+    table.emplace(hash, this->answers.size());
+    this->answers.push_back(std::move(answer));
+}
+
+auto AnswerTable::lookup(const std::unordered_multimap<size_t, uint32_t>& table,
+                         std::string_view owner, uint16_t qtype) const
+    -> const Answer* {
+    auto [first, last] = table.equal_range(answer_hash(owner, qtype));
+
+    for (auto it = first; it != last; it++) {
+        const auto& answer = this->answers[it->second];
+        if (answer.qtype == qtype && answer.owner == owner) {
+            return &answer;
+        }
+    }
+    return nullptr;
+}
+
+auto AnswerTable::table_of(uint16_t qtype) const
+    -> const std::unordered_multimap<size_t, uint32_t>& {
+    return qtype == 0 ? this->missing : this->index;
+}
@@ -2,126 +2,258 @@
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 
+#include <algorithm>
+#include <charconv>
 #include <fstream>
 #include <iostream>
 
+#include "image.hpp"
 #include "spdlog/fmt/bin_to_hex.h"
+#include "strategy.hpp"
 #include "util.hpp"
 
-auto ServerBuilder::bind(uint16_t port) -> Server {
-    this->server.forward_sin = {
-        .sin_family = AF_INET,
-        .sin_port = htons(FORWARD_PORT),
-    };
+// Every worker listens on the shared port; SO_REUSEPORT spreads new
+// connections across them as it does datagrams.
+static auto listen_stream(const sockaddr_in& sin) -> int {
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+    if (sock < 0) {
+        err_quit("Fail to build TCP socket");
+    }
 
-    int ret = inet_pton(AF_INET, this->forward_ip.data(),
-                        &this->server.forward_sin.sin_addr);
+    int on = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
 
-    if (ret <= 0) {
-        err_quit(
-            ("Can't convert IPv4 address for " + this->forward_ip).c_str());
+    if (::bind(sock, (sockaddr*)&sin, sizeof(sin)) < 0) {
+        err_quit("Fail to bind TCP port");
     }
 
-    sockaddr_in client_sin{.sin_family = AF_INET, .sin_port = htons(port)};
-
-    this->server.client_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-    if ((this->server.client_sock) < 0) {
-        err_quit("Fail to build user socket");
+    if (listen(sock, TCP_BACKLOG) < 0) {
+        err_quit("Fail to listen on TCP port");
     }
+    return sock;
+}
 
-    int on = 1;
-    setsockopt(this->server.client_sock, SOL_SOCKET, SO_REUSEADDR, &on,
-               sizeof(on));
+auto parse_upstreams(const std::string& line)
+    -> std::vector<sockaddr_in> {
+    std::vector<sockaddr_in> upstreams;
+    for (const auto& field : split(line, ',')) {
+        std::string spec = trim(field);
+        if (spec.empty()) {
+            continue;
+        }
+
+        sockaddr_in sin{.sin_family = AF_INET, .sin_port = htons(FORWARD_PORT)};
+        std::string address = spec;
+        auto colon = spec.find(':');
+        if (colon != std::string::npos) {
+            address = spec.substr(0, colon);
+            try {
+                sin.sin_port = htons(std::stoul(spec.substr(colon + 1)));
+            } catch (const std::exception&) {
+                err_quit("Invalid port for upstream " + spec);
+            }
+        }
 
-    if (::bind(this->server.client_sock, (sockaddr*)&client_sin,
-               sizeof(client_sin)) < 0) {
-        err_quit("Fail to bind client port");
+        if (inet_pton(AF_INET, address.c_str(), &sin.sin_addr) <= 0) {
+            err_quit("Can't convert IPv4 address for " + address);
+        }
+        upstreams.push_back(sin);
     }
 
-    sockaddr_in forward_sin{.sin_family = AF_INET, .sin_port = htons(port + 1)};
+    if (upstreams.empty()) {
+        err_quit("No upstream to forward to");
+    }
+    if (upstreams.size() > MAX_UPSTREAMS) {
+        err_quit(fmt::format("At most {} upstreams are supported",
+                             MAX_UPSTREAMS));
+    }
+    return upstreams;
+}
 
-    this->server.forward_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-    if ((this->server.forward_sock) < 0) {
-        err_quit("Fail to build forward socket");
+auto ServerBuilder::bind(uint16_t port) -> Server {
+    auto upstreams = parse_upstreams(this->forward_ip);
+
+    sockaddr_in client_sin{.sin_family = AF_INET, .sin_port = htons(port)};
+
+    for (size_t i = 0; i < this->n_workers; i++) {
+        Worker worker{.id = i};
+
+        worker.client_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if (worker.client_sock < 0) {
+            err_quit("Fail to build user socket");
+        }
+
+        int on = 1;
+        setsockopt(worker.client_sock, SOL_SOCKET, SO_REUSEADDR, &on,
+                   sizeof(on));
+        setsockopt(worker.client_sock, SOL_SOCKET, SO_REUSEPORT, &on,
+                   sizeof(on));
+
+        if (::bind(worker.client_sock, (sockaddr*)&client_sin,
+                   sizeof(client_sin)) < 0) {
+            err_quit("Fail to bind client port");
+        }
+
+        // Forward sockets are connected, one per upstream, and so take an
+        // ephemeral port each: upstream replies all come from the same
+        // address, so a shared port could not route them back to the
+        // worker that sent the query.
+        for (const auto& addr : upstreams) {
+            Upstream upstream{.addr = addr};
+            upstream.sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+            if (upstream.sock < 0) {
+                err_quit("Fail to build forward socket");
+            }
+
+            if (connect(upstream.sock, (sockaddr*)&addr, sizeof(addr)) < 0) {
+                err_quit("Fail to connect forward socket");
+            }
+            worker.forwarder.upstreams.push_back(upstream);
+        }
+        worker.forwarder.metrics = worker.metrics;
+
+        if (this->tcp_connections > 0) {
+            worker.streams.listen_sock = listen_stream(client_sin);
+            worker.update_replies->event =
+                eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (worker.update_replies->event < 0) {
+                err_quit("Fail to create update reply event");
+            }
+            worker.streams.max_connections =
+                (this->tcp_connections + this->n_workers - 1) /
+                this->n_workers;
+        }
+
+        this->server.workers.push_back(worker);
     }
 
-    on = 1;
-    setsockopt(this->server.forward_sock, SOL_SOCKET, SO_REUSEADDR, &on,
-               sizeof(on));
+    this->snapshot->render(this->server.registered_handler);
+    this->server.snapshots =
+        std::make_shared<SnapshotRcu>(this->server.workers.size());
+    this->server.snapshots->publish(std::move(this->snapshot));
+    this->server.updater = std::make_shared<Updater>(
+        this->server.snapshots, this->loader, this->server.registered_handler,
+        this->update_allowed);
+
+    if (this->cache_size > 0) {
+        this->server.cache = std::make_shared<ResponseCache>(
+            this->cache_size, this->prefetch_percent, this->prefetch_hits);
+    }
+
+    if (this->rrl_rate > 0) {
+        this->server.rate_limiter = std::make_shared<RateLimiter>(
+            this->rrl_rate, this->rrl_slip, DEFAULT_RRL_BUCKETS);
+    }
 
-    if (::bind(this->server.forward_sock, (sockaddr*)&forward_sin,
-               sizeof(forward_sin)) < 0) {
-        err_quit("Fail to bind forward port");
+    if (!this->stats_path.empty()) {
+        std::vector<std::shared_ptr<WorkerMetrics>> metrics;
+        for (const auto& worker : this->server.workers) {
+            metrics.push_back(worker.metrics);
+        }
+        this->server.stats =
+            std::make_shared<StatsListener>(this->stats_path, metrics);
     }
 
     return this->server;
 }
 
-auto ServerBuilder::load_config(const fs::path& config_path) -> ServerBuilder& {
-    std::ifstream ifs(config_path);
-    if (!ifs.is_open()) {
-        err_quit("Fail to open config file");
+auto ServerBuilder::compile(const fs::path& image_path) -> void {
+    if (!this->snapshot->collection) {
+        err_quit("Zone images can't be compiled again");
     }
 
-    spdlog::info("Reading config file {}", config_path.string());
+    AnswerTable table;
+    table.render(*this->snapshot->collection, this->server.registered_handler);
+
+    if (!ZoneImage::write(image_path, this->forward_ip, table)) {
+        err_quit("Fail to compile zone image");
+    }
+}
 
-    if (!std::getline(ifs, this->forward_ip)) {
-        err_quit("Fail to get forward ip");
+auto ServerBuilder::load_config(const fs::path& config_path) -> ServerBuilder& {
+    this->loader.path = config_path;
+    this->snapshot = this->loader.load();
+    if (!this->snapshot) {
+        exit(EXIT_FAILURE);
     }
 
-    this->forward_ip = trim(this->forward_ip);
+    this->forward_ip = this->snapshot->forward_ip;
+    return *this;
+}
 
-    std::string line;
-    while (std::getline(ifs, line)) {
-        auto split_line = split(line, ',');
-        if (split_line.size() < 2) {
-            err_quit("config file format incorrect");
+auto ServerBuilder::set_update_allow(const std::vector<std::string>& addresses)
+    -> ServerBuilder& {
+    this->update_allowed.clear();
+    for (const auto& address : addresses) {
+        in_addr addr;
+        if (inet_pton(AF_INET, trim(address).c_str(), &addr) <= 0) {
+            err_quit("Can't convert IPv4 address for " + address);
         }
+        this->update_allowed.push_back(addr.s_addr);
+    }
+    return *this;
+}
 
-        std::string domain = std::move(split_line[0]);
-        std::string filename = std::move(split_line[1]);
+auto ServerBuilder::set_loaders(size_t n_loaders) -> ServerBuilder& {
+    this->loader.n_threads = std::max<size_t>(n_loaders, 1);
+    return *this;
+}
 
-        fs::path zone_path = config_path.parent_path() / filename;
-        spdlog::info("Reading zone file {}", zone_path.string());
-        load_zone(zone_path);
-    }
+auto ServerBuilder::set_workers(size_t n_workers) -> ServerBuilder& {
+    this->n_workers = std::max<size_t>(n_workers, 1);
     return *this;
 }
 
-void ServerBuilder::load_zone(const fs::path& zone_path) {
-    std::ifstream ifs(zone_path);
-    if (!ifs.is_open()) {
-        err_quit("Fail to open zone file");
-    }
+auto ServerBuilder::set_stats_socket(std::string path) -> ServerBuilder& {
+    this->stats_path = std::move(path);
+    return *this;
+}
 
-    std::string domain, line;
-    if (!std::getline(ifs, domain)) {
-        err_quit("Fail to get domain");
-    }
+auto ServerBuilder::set_backend(Backend backend) -> ServerBuilder& {
+    this->server.backend = backend;
+    return *this;
+}
 
-    domain = trim(domain);
+auto ServerBuilder::set_edns_size(size_t edns_size) -> ServerBuilder& {
+    this->server.edns_size = std::clamp<size_t>(edns_size, MIN_UDP_SIZE,
+                                                PACKET_SIZE);
+    return *this;
+}
 
-    while (std::getline(ifs, line)) {
-        spdlog::debug("{}", line);
-        auto slices = split(line, ',');
+auto ServerBuilder::set_batch_size(size_t batch_size) -> ServerBuilder& {
+    this->server.batch_size = std::max<size_t>(batch_size, 1);
+    return *this;
+}
 
-        if (slices.size() < 5) {
-            spdlog::warn("Invalid record: {}", line);
-            continue;
-        }
+auto ServerBuilder::set_tcp_connections(size_t tcp_connections)
+    -> ServerBuilder& {
+    this->tcp_connections = tcp_connections;
+    return *this;
+}
 
-        auto r = RecordBuilder()
-                     .set_name(slices[0])
-                     .set_ttl(slices[1])
-                     .set_class(slices[2])
-                     .set_type(slices[3])
-                     .set_rdata(split(slices[4]))
-                     .build();
+// A rate of 0 leaves response rate limiting off.
+auto ServerBuilder::set_rate_limit(size_t rate, size_t slip)
+    -> ServerBuilder& {
+    this->rrl_rate = rate;
+    this->rrl_slip = slip;
+    return *this;
+}
 
-        this->server.collection.add_record(domain, r);
-    }
+auto ServerBuilder::set_cache_size(size_t cache_size) -> ServerBuilder& {
+    this->cache_size = cache_size;
+    return *this;
+}
+
+// A percent of 0 leaves prefetching off.
+auto ServerBuilder::set_prefetch(size_t percent, size_t min_hits)
+    -> ServerBuilder& {
+    this->prefetch_percent = std::min<size_t>(percent, 100);
+    this->prefetch_hits = std::max<size_t>(min_hits, 1);
+    return *this;
 }
 
 auto ServerBuilder::register_fn(Record::Type type,
@@ -131,30 +263,43 @@ auto ServerBuilder::register_fn(Record::Type type,
     return *this;
 }
 
+auto ServerBuilder::register_defaults() -> ServerBuilder& {
+    return this->register_fn(Record::A, std::make_shared<ARecordResponder>())
+        .register_fn(Record::NS, std::make_shared<NSRecordResponder>())
+        .register_fn(Record::MX, std::make_shared<MXRecordResponder>())
+        .register_fn(Record::SOA, std::make_shared<SOARecordResponder>())
+        .register_fn(Record::TXT, std::make_shared<TXTRecordResponder>())
+        .register_fn(Record::AAAA, std::make_shared<AAAARecordResponder>())
+        .register_fn(Record::CNAME, std::make_shared<CNAMERecordResponder>());
+}
+
 auto RecordBuilder::set_name(const std::string& name) -> RecordBuilder& {
     this->record.r_name = name;
     return *this;
 }
 
 auto RecordBuilder::set_type(const std::string& type) -> RecordBuilder& {
-    static std::map<std::string, Record::Type> type_value = {
+    static const std::map<std::string, Record::Type> type_value = {
         {"A", Record::Type::A},         {"NS", Record::Type::NS},
         {"CNAME", Record::Type::CNAME}, {"SOA", Record::Type::SOA},
         {"MX", Record::Type::MX},       {"TXT", Record::Type::TXT},
         {"AAAA", Record::Type::AAAA}};
 
-    this->record.r_type = type_value[type];
+    auto value = type_value.find(type);
+    this->record.r_type = value == type_value.end() ? 0 : value->second;
     return *this;
 }
 
 auto RecordBuilder::set_class(const std::string& r_class) -> RecordBuilder& {
-    static std::map<std::string, Record::Class> class_value = {
+    static const std::map<std::string, Record::Class> class_value = {
         {"IN", Record::Class::IN},
         {"CS", Record::Class::CS},
         {"CH", Record::Class::CH},
         {"HS", Record::Class::HS}};
 
-    this->record.r_class = class_value[r_class];
+    // Loader threads share the map, so an unknown class must not insert.
+    auto value = class_value.find(r_class);
+    this->record.r_class = value == class_value.end() ? 0 : value->second;
     return *this;
 }
 
@@ -165,21 +310,230 @@ auto RecordBuilder::set_ttl(const std::string& ttl) -> RecordBuilder& {
 
 auto RecordBuilder::set_rdata(const std::vector<std::string>& data)
     -> RecordBuilder& {
-    this->record.r_rdata = data;
+    this->rdata = data;
     return *this;
 }
 
-auto RecordBuilder::build() -> Record { return this->record; }
+auto RecordBuilder::build() -> std::optional<Record> {
+    if (this->record.r_class == 0) {
+        return {};
+    }
+
+    auto rdata = this->parse_rdata();
+    if (!rdata) {
+        return {};
+    }
+
+    this->record.r_rdata = std::move(*rdata);
+    return this->record;
+}
+
+static auto parse_u32(const std::string& value) -> std::optional<uint32_t> {
+    uint32_t number = 0;
+    const char* end = value.data() + value.size();
+    auto [ptr, ec] = std::from_chars(value.data(), end, number);
+    if (ec != std::errc() || ptr != end) {
+        return {};
+    }
+    return number;
+}
+
+auto RecordBuilder::parse_rdata() -> std::optional<RData> {
+    const auto& data = this->rdata;
+
+    switch (this->record.r_type) {
+        case Record::A: {
+            AData a{};
+            if (data.size() != 1 ||
+                inet_pton(AF_INET, data[0].c_str(), &a.address) <= 0) {
+                return {};
+            }
+            return a;
+        }
+        case Record::AAAA: {
+            AAAAData aaaa{};
+            if (data.size() != 1 ||
+                inet_pton(AF_INET6, data[0].c_str(), &aaaa.address) <= 0) {
+                return {};
+            }
+            return aaaa;
+        }
+        case Record::NS:
+        case Record::CNAME: {
+            if (data.size() != 1 || data[0].empty()) {
+                return {};
+            }
+            return NameData{data[0]};
+        }
+        case Record::MX: {
+            if (data.size() != 2) {
+                return {};
+            }
+
+            auto preference = parse_u32(data[0]);
+            if (!preference || *preference > UINT16_MAX) {
+                return {};
+            }
+            return MXData{htons(*preference), data[1]};
+        }
+        case Record::SOA: {
+            if (data.size() != 7) {
+                return {};
+            }
+
+            uint32_t fields[5];
+            for (size_t i = 0; i < 5; i++) {
+                auto field = parse_u32(data[i + 2]);
+                if (!field) {
+                    return {};
+                }
+                fields[i] = htonl(*field);
+            }
+            return SOAData{data[0],   data[1],   fields[0], fields[1],
+                           fields[2], fields[3], fields[4]};
+        }
+        case Record::TXT: {
+            std::string text;
+            for (const auto& part : data) {
+                text += (text.empty() ? "" : " ") + part;
+            }
+
+            if (text.size() > UINT8_MAX) {
+                return {};
+            }
+            return TXTData{text};
+        }
+    }
+    return {};
+}
+
+auto ResponseWriter::write(const void* data, size_t dlen) -> ResponseWriter& {
+    if (this->nbytes + dlen > PACKET_SIZE) {
+        this->overflow = true;
+        return *this;
+    }
 
-auto PacketBuilder::write(void* data, size_t dlen) -> PacketBuilder& {
-    // spdlog::debug("Write from {} to {}", this->nbytes, this->nbytes + dlen);
-    std::copy_n(reinterpret_cast<uint8_t*>(data), dlen,
+    std::copy_n(reinterpret_cast<const uint8_t*>(data), dlen,
                 this->buffer + this->nbytes);
     this->nbytes += dlen;
     return *this;
 }
 
-auto PacketBuilder::create() -> Packet {
+auto ResponseWriter::name(std::string_view name) -> ResponseWriter& {
+    if (!name.empty() && name.back() == '.') {
+        name.remove_suffix(1);
+    }
+
+    // After an overflow, offsets no longer match what was written.
+    while (!name.empty() && !this->overflow) {
+        auto known = std::find_if(
+            this->suffixes.begin(), this->suffixes.end(),
+            [name](const auto& suffix) { return suffix.first == name; });
+
+        if (known != this->suffixes.end()) {
+            uint16_t pointer = htons(0xc000 | known->second);
+            return this->write(&pointer, sizeof(pointer));
+        }
+
+        // Pointers only have 14 bits of offset.
+        if (this->nbytes < 0x4000) {
+            this->suffixes.emplace_back(name, this->nbytes);
+        }
+
+        size_t dot = name.find('.');
+        auto label = name.substr(0, dot);
+        name = dot == std::string_view::npos ? std::string_view{}
+                                             : name.substr(dot + 1);
+
+        if (label.empty()) {
+            continue;
+        }
+
+        uint8_t label_len = label.size();
+        this->write(&label_len, sizeof(label_len))
+            .write(label.data(), label.size());
+    }
+
+    uint8_t root = 0;
+    return this->write(&root, sizeof(root));
+}
+
+auto ResponseWriter::question(const Query& query) -> ResponseWriter& {
+    uint16_t qtype = htons(query.qtype);
+    uint16_t qclass = htons(query.qclass);
+
+    return this->name(query.qname)
+        .write(&qtype, sizeof(qtype))
+        .write(&qclass, sizeof(qclass));
+}
+
+auto ResponseWriter::record(std::string_view owner, const Record& record)
+    -> ResponseWriter& {
+    this->name(owner);
+
+    RecordParmas record_params = {
+        .r_type = htons(record.r_type),
+        .r_class = htons(record.r_class),
+        .r_ttl = htonl(record.r_ttl),
+        .r_rdlength = 0,
+    };
+    this->write(&record_params, sizeof(record_params));
+
+    size_t rdata_start = this->nbytes;
+    this->rdata(record);
+
+    if (!this->overflow) {
+        uint16_t rdlength = htons(this->nbytes - rdata_start);
+        std::copy_n(reinterpret_cast<uint8_t*>(&rdlength), sizeof(rdlength),
+                    this->buffer + rdata_start - sizeof(rdlength));
+    }
+    return *this;
+}
+
+auto ResponseWriter::rdata(const Record& record) -> ResponseWriter& {
+    switch (record.r_type) {
+        case Record::A: {
+            const auto& a = std::get<AData>(record.r_rdata);
+            return this->write(&a.address, sizeof(a.address));
+        }
+        case Record::AAAA: {
+            const auto& aaaa = std::get<AAAAData>(record.r_rdata);
+            return this->write(&aaaa.address, sizeof(aaaa.address));
+        }
+        case Record::NS:
+        case Record::CNAME:
+            return this->name(std::get<NameData>(record.r_rdata).name);
+        case Record::MX: {
+            const auto& mx = std::get<MXData>(record.r_rdata);
+            return this->write(&mx.preference, sizeof(mx.preference))
+                .name(mx.exchange);
+        }
+        case Record::SOA: {
+            const auto& soa = std::get<SOAData>(record.r_rdata);
+            return this->name(soa.mname)
+                .name(soa.rname)
+                .write(&soa.serial, sizeof(soa.serial))
+                .write(&soa.refresh, sizeof(soa.refresh))
+                .write(&soa.retry, sizeof(soa.retry))
+                .write(&soa.expire, sizeof(soa.expire))
+                .write(&soa.minimum, sizeof(soa.minimum));
+        }
+        case Record::TXT: {
+            const auto& txt = std::get<TXTData>(record.r_rdata);
+            uint8_t txtlen = txt.text.size();
+            return this->write(&txtlen, sizeof(txtlen))
+                .write(txt.text.data(), txtlen);
+        }
+    }
+    return *this;
+}
+
+auto ResponseWriter::create() -> std::optional<Packet> {
+    if (this->overflow) {
+        spdlog::debug("Response exceeds {} bytes", PACKET_SIZE);
+        return {};
+    }
+
     size_t header_len = sizeof(this->packet.header);
     this->packet.plen = this->nbytes - header_len;
 
@@ -0,0 +1,250 @@
+#include "cache.hpp"
+
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <functional>
+
+#include "forwarder.hpp"
+#include "spdlog/spdlog.h"
+
+using Clock = std::chrono::steady_clock;
+
+// Lower-cases `name` into `out`, which must hold MAX_NAME_SIZE bytes.
+static auto lower(std::string_view name, char* out) -> std::string_view {
+    size_t len = std::min(name.size(), MAX_NAME_SIZE);
+    std::transform(name.begin(), name.begin() + len, out,
+                   [](unsigned char c) { return std::tolower(c); });
+    return std::string_view(out, len);
+}
+
+static auto key_hash(std::string_view qname, uint16_t qtype, uint16_t qclass)
+    -> size_t {
+    size_t h = std::hash<std::string_view>{}(qname);
+    return h ^ ((static_cast<size_t>(qtype) << 16 | qclass) *
+                0x9e3779b97f4a7c15ULL);
+}
+
+// Returns the offset just past the (possibly compressed) name at `cursor`.
+static auto skip_name(const uint8_t* data, size_t len, size_t cursor)
+    -> std::optional<size_t> {
+    while (cursor < len) {
+        uint8_t label_len = data[cursor];
+        if ((label_len & 0xc0) == 0xc0) {
+            return cursor + 2;
+        }
+        cursor += label_len + 1;
+        if (label_len == 0) {
+            return cursor;
+        }
+    }
+    return {};
+}
+
+auto CacheEntry::size() const -> size_t {
+    return sizeof(CacheEntry) + this->qname.size() + this->wire.size() +
+           this->ttl_offsets.size() * sizeof(uint16_t);
+}
+
+ResponseCache::ResponseCache(size_t capacity, size_t prefetch_percent,
+                             uint32_t prefetch_hits)
+    : shard_capacity(capacity / CACHE_SHARDS),
+      prefetch_percent(prefetch_percent),
+      prefetch_hits(prefetch_hits) {}
+
+auto ResponseCache::lookup(const PacketView& query, uint8_t* out, size_t size,
+                           bool& refresh) -> size_t {
+    refresh = false;
+
+    char name[MAX_NAME_SIZE];
+    auto qname = lower(query.qname(), name);
+    size_t hash = key_hash(qname, query.qtype, query.qclass);
+    auto& shard = this->shards[hash % CACHE_SHARDS];
+
+    size_t len;
+    {
+        std::lock_guard lock(shard.mutex);
+
+        auto found = find(shard, hash, qname, query.qtype, query.qclass);
+        if (!found) {
+            return 0;
+        }
+
+        auto it = *found;
+        auto now = Clock::now();
+        if (now >= it->expires) {
+            evict(shard, it);
+            return 0;
+        }
+
+        len = it->wire.size();
+        if (len > size || query.question_end > len) {
+            return 0;
+        }
+
+        shard.lru.splice(shard.lru.begin(), shard.lru, it);
+        std::copy(it->wire.begin(), it->wire.end(), out);
+
+        it->hits++;
+        if (this->prefetch_percent > 0 &&
+            now - it->refreshing >= FORWARD_TIMEOUT &&
+            it->hits >= this->prefetch_hits &&
+            (it->expires - now) * 100 <=
+                (it->expires - it->stored) * this->prefetch_percent) {
+            it->refreshing = now;
+            refresh = true;
+        }
+
+        uint32_t age = std::chrono::duration_cast<std::chrono::seconds>(
+                           now - it->stored)
+                           .count();
+
+        for (auto offset : it->ttl_offsets) {
+            uint32_t ttl;
+            std::copy_n(out + offset, sizeof(ttl),
+                        reinterpret_cast<uint8_t*>(&ttl));
+            ttl = htonl(ntohl(ttl) > age ? ntohl(ttl) - age : 0);
+            std::copy_n(reinterpret_cast<uint8_t*>(&ttl), sizeof(ttl),
+                        out + offset);
+        }
+    }
+
+    // Answer under this client's ID and echo the question as it spelled it.
+    uint16_t id = htons(query.header.dns_id);
+    std::copy_n(reinterpret_cast<uint8_t*>(&id), sizeof(id), out);
+    std::copy(query.data + sizeof(Header), query.data + query.question_end,
+              out + sizeof(Header));
+
+    return len;
+}
+
+auto ResponseCache::store(const uint8_t* wire, size_t len) -> void {
+    if (this->shard_capacity == 0) {
+        return;
+    }
+
+    auto reply = PacketView::parse(wire, len);
+    if (!reply) {
+        return;
+    }
+
+    const Header& header = reply->header;
+    if (header.dns_rcode != 0 || header.dns_tc || header.dns_qdcount != 1 ||
+        header.dns_ancount == 0) {
+        return;
+    }
+
+    char name[MAX_NAME_SIZE];
+    auto qname = lower(reply->qname(), name);
+
+    CacheEntry entry{};
+    entry.qname = qname;
+    entry.qtype = reply->qtype;
+    entry.qclass = reply->qclass;
+    entry.hash = key_hash(qname, reply->qtype, reply->qclass);
+    entry.wire.assign(wire, wire + len);
+
+    std::optional<size_t> cursor = reply->question_end;
+    std::optional<size_t> opt_start;
+    uint32_t min_ttl = MAX_CACHE_TTL;
+    size_t nrecords =
+        header.dns_ancount + header.dns_nscount + header.dns_arcount;
+
+    for (size_t i = 0; i < nrecords; i++) {
+        size_t owner = *cursor;
+        cursor = skip_name(wire, len, *cursor);
+        if (!cursor || *cursor + 10 > len) {
+            return;
+        }
+
+        uint16_t type, rdlength;
+        uint32_t ttl;
+        std::copy_n(wire + *cursor, sizeof(type),
+                    reinterpret_cast<uint8_t*>(&type));
+        std::copy_n(wire + *cursor + 4, sizeof(ttl),
+                    reinterpret_cast<uint8_t*>(&ttl));
+        std::copy_n(wire + *cursor + 8, sizeof(rdlength),
+                    reinterpret_cast<uint8_t*>(&rdlength));
+
+        // The OPT pseudo-record keeps flags in its TTL field.
+        opt_start.reset();
+        if (ntohs(type) == OPT_TYPE) {
+            opt_start = owner;
+        } else {
+            entry.ttl_offsets.push_back(*cursor + 4);
+            if (i < header.dns_ancount) {
+                min_ttl = std::min(min_ttl, ntohl(ttl));
+            }
+        }
+
+        *cursor += 10 + ntohs(rdlength);
+    }
+
+    if (*cursor > len || min_ttl == 0) {
+        return;
+    }
+
+    // The upstream OPT answered one client's EDNS; each hit gets the
+    // server's own instead. Only an OPT that ends the message is cut.
+    if (opt_start && *cursor == len) {
+        entry.wire.resize(*opt_start);
+        auto cached = reinterpret_cast<Header*>(entry.wire.data());
+        cached->dns_arcount = htons(header.dns_arcount - 1);
+    }
+
+    entry.stored = Clock::now();
+    entry.expires = entry.stored + std::chrono::seconds(min_ttl);
+
+    size_t size = entry.size();
+    if (size > this->shard_capacity) {
+        return;
+    }
+
+    auto& shard = this->shards[entry.hash % CACHE_SHARDS];
+    std::lock_guard lock(shard.mutex);
+
+    auto found =
+        find(shard, entry.hash, entry.qname, entry.qtype, entry.qclass);
+    if (found) {
+        entry.hits = (*found)->hits / 2;
+        evict(shard, *found);
+    }
+
+    while (shard.bytes + size > this->shard_capacity) {
+        evict(shard, std::prev(shard.lru.end()));
+    }
+
+    spdlog::debug("Cache {} for {}s", entry.qname, min_ttl);
+
+    shard.lru.push_front(std::move(entry));
+    shard.index.emplace(shard.lru.front().hash, shard.lru.begin());
+    shard.bytes += size;
+}
+
+auto ResponseCache::find(Shard& shard, size_t hash, std::string_view qname,
+                         uint16_t qtype, uint16_t qclass)
+    -> std::optional<Iterator> {
+    auto [first, last] = shard.index.equal_range(hash);
+
+    for (auto it = first; it != last; it++) {
+        const auto& entry = *it->second;
+        if (entry.qtype == qtype && entry.qclass == qclass &&
+            entry.qname == qname) {
+            return it->second;
+        }
+    }
+    return {};
+}
+
+auto ResponseCache::evict(Shard& shard, Iterator it) -> void {
+    auto [first, last] = shard.index.equal_range(it->hash);
+    for (auto entry = first; entry != last; entry++) {
+        if (entry->second == it) {
+            shard.index.erase(entry);
+            break;
+        }
+    }
+
+    shard.bytes -= it->size();
+    shard.lru.erase(it);
+}
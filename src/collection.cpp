@@ -1,48 +1,203 @@
 #include "collection.hpp"
 
+#include <functional>
+
 #include "util.hpp"
 
+ZoneTrie::ZoneTrie() : nodes(1) {}
+
+auto ZoneTrie::insert(const std::string& zone) -> void {
+    std::string_view name = zone;
+    if (!name.empty() && name.back() == '.') {
+        name.remove_suffix(1);
+    }
+
+    uint32_t node = 0;
+    size_t end = name.size();
+
+    while (end > 0) {
+        size_t dot = name.rfind('.', end - 1);
+        size_t start = dot == std::string_view::npos ? 0 : dot + 1;
+        auto label = name.substr(start, end - start);
+
+        auto next = this->child(node, label);
+        if (!next) {
+            next = this->nodes.size();
+            this->nodes.push_back(Node{.label = std::string(label)});
+            this->nodes[node].children.emplace(
+                std::hash<std::string_view>{}(label), *next);
+        }
+        node = *next;
+
+        if (dot == std::string_view::npos) {
+            break;
+        }
+        end = dot;
+    }
+
+    this->nodes[node].zone = zone;
+}
+
+auto ZoneTrie::find(std::string_view qname) const -> const std::string* {
+    std::string_view name = qname;
+    if (!name.empty() && name.back() == '.') {
+        name.remove_suffix(1);
+    }
+
+    uint32_t node = 0;
+    const std::string* closest =
+        this->nodes[0].zone ? &*this->nodes[0].zone : nullptr;
+    size_t end = name.size();
+
+    while (end > 0) {
+        size_t dot = name.rfind('.', end - 1);
+        size_t start = dot == std::string_view::npos ? 0 : dot + 1;
+
+        auto next = this->child(node, name.substr(start, end - start));
+        if (!next) {
+            break;
+        }
+        node = *next;
+
+        if (this->nodes[node].zone) {
+            closest = &*this->nodes[node].zone;
+        }
+
+        if (dot == std::string_view::npos) {
+            break;
+        }
+        end = dot;
+    }
+
+    return closest;
+}
+
+auto ZoneTrie::child(uint32_t parent, std::string_view label) const
+    -> std::optional<uint32_t> {
+    auto [first, last] = this->nodes[parent].children.equal_range(
+        std::hash<std::string_view>{}(label));
+
+    for (auto it = first; it != last; it++) {
+        if (this->nodes[it->second].label == label) {
+            return it->second;
+        }
+    }
+    return {};
+}
+
+static auto rrset_hash(std::string_view owner, uint16_t qtype, uint16_t qclass)
+    -> size_t {
+    size_t h = std::hash<std::string_view>{}(owner);
+    return h ^ ((static_cast<size_t>(qtype) << 16 | qclass) *
+                0x9e3779b97f4a7c15ULL);
+}
+
 auto Collection::add_record(const std::string& domain, const Record& record)
     -> void {
-    this->records[domain].push_back(record);
+    const std::string* known = this->zones.find(domain);
+    if (known == nullptr || *known != domain) {
+        this->zones.insert(domain);
+        this->domains.push_back(domain);
+    }
+
+    std::string owner =
+        record.r_name == "@" ? domain : record.r_name + "." + domain;
+
+    auto rrset = this->find_rrset(owner, record.r_type, record.r_class);
+    if (rrset != nullptr) {
+        this->rrsets[rrset - this->rrsets.data()].records.push_back(record);
+        return;
+    }
+
+    this->index.emplace(rrset_hash(owner, record.r_type, record.r_class),
+                        this->rrsets.size());
+    this->rrsets.push_back(RRset{
+        .owner = std::move(owner),
+        .r_type = record.r_type,
+        .r_class = record.r_class,
+        .records = {record},
+    });
 }
 
-auto Collection::search_domain(const std::string& qname) const
-    -> std::optional<std::string> {
-    for (const auto& [domain_name, domain_records] : this->records) {
-        if (qname.find(domain_name) != std::string::npos) {
-            return domain_name;
+auto Collection::replace(RRset rrset) -> void {
+    auto known = this->find_rrset(rrset.owner, rrset.r_type, rrset.r_class);
+    if (known != nullptr) {
+        this->rrsets[known - this->rrsets.data()] = std::move(rrset);
+        return;
+    }
+
+    this->index.emplace(rrset_hash(rrset.owner, rrset.r_type, rrset.r_class),
+                        this->rrsets.size());
+    this->rrsets.push_back(std::move(rrset));
+}
+
+auto Collection::flatten() const -> Collection {
+    if (!this->base) {
+        return *this;
+    }
+
+    Collection flat;
+    flat.domains = this->base->domains;
+    flat.zones = this->base->zones;
+
+    auto keep = [&flat](const RRset& rrset) {
+        if (rrset.records.empty()) {
+            return;
+        }
+        flat.index.emplace(
+            rrset_hash(rrset.owner, rrset.r_type, rrset.r_class),
+            flat.rrsets.size());
+        flat.rrsets.push_back(rrset);
+    };
+
+    for (const auto& rrset : this->base->rrsets) {
+        if (this->find_rrset(rrset.owner, rrset.r_type, rrset.r_class) ==
+            nullptr) {
+            keep(rrset);
         }
     }
-    return {};
+
+    for (const auto& rrset : this->rrsets) {
+        keep(rrset);
+    }
+
+    return flat;
 }
 
-auto Collection::search_records(const std::string& qname, uint16_t qtype,
-                                uint16_t qclass) const -> std::vector<Record> {
-    auto domain_name = search_domain(qname);
-    if (!domain_name) {
+auto Collection::search_domain(const std::string& qname) const
+    -> std::optional<std::string> {
+    if (this->base) {
+        return this->base->search_domain(qname);
+    }
+
+    const std::string* domain_name = this->zones.find(qname);
+    if (domain_name == nullptr) {
         return {};
     }
+    return *domain_name;
+}
 
-    std::string subdomain;
-    if (qname == *domain_name) {
-        subdomain = "@";
-    } else {
-        size_t pos = qname.find(*domain_name);
-        subdomain = qname.substr(0, pos - 1);
+auto Collection::search_records(const std::string& qname, uint16_t qtype,
+                                uint16_t qclass) const -> RecordSpan {
+    auto rrset = this->find_rrset(qname, qtype, qclass);
+    if (rrset == nullptr) {
+        return this->base ? this->base->search_records(qname, qtype, qclass)
+                          : RecordSpan();
     }
+    return RecordSpan(rrset->records.data(), rrset->records.size());
+}
 
-    std::vector<Record> ret, domain_records = this->records.at(*domain_name);
-    for (const auto& record : domain_records) {
-        if (record.r_name != subdomain || record.r_type != qtype) {
-            continue;
+auto Collection::find_rrset(std::string_view owner, uint16_t qtype,
+                            uint16_t qclass) const -> const RRset* {
+    auto [first, last] =
+        this->index.equal_range(rrset_hash(owner, qtype, qclass));
+
+    for (auto it = first; it != last; it++) {
+        const auto& rrset = this->rrsets[it->second];
+        if (rrset.r_type == qtype && rrset.r_class == qclass &&
+            rrset.owner == owner) {
+            return &rrset;
         }
-        ret.push_back(record);
     }
-
-    return filter(
-        domain_records, [&subdomain, qtype, qclass](const Record& record) {
-            return (record.r_name == subdomain && record.r_type == qtype &&
-                    record.r_class == qclass);
-        });
+    return nullptr;
 }
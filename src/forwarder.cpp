@@ -0,0 +1,525 @@
+#include "forwarder.hpp"
+
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "builder.hpp"
+#include "spdlog/spdlog.h"
+#include "util.hpp"
+
+constexpr size_t NO_UPSTREAM = SIZE_MAX;
+
+static auto address_of(const sockaddr_in& sin) -> std::string {
+    char text[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &sin.sin_addr, text, sizeof(text));
+    return fmt::format("{}:{}", text, ntohs(sin.sin_port));
+}
+
+// The SERVFAIL a waiting client gets once its query is given up on.
+static auto servfail(const Query& query, const Waiter& waiter)
+    -> std::optional<Packet> {
+    Header header = waiter.header;
+    header.dns_qr = 1;
+    header.dns_ra = 1;
+    header.dns_rcode = 2;  // SERVFAIL
+    header.dns_qdcount = 1;
+    header.dns_ancount = 0;
+    header.dns_nscount = 0;
+    header.dns_arcount = 0;
+    header = Header::to_response(header);
+
+    return ResponseWriter()
+        .write(&header, sizeof(header))
+        .question(query)
+        .create();
+}
+
+auto Upstream::healthy(Clock::time_point now) const -> bool {
+    return this->error_rate < UPSTREAM_MAX_ERROR_RATE ||
+           now >= this->skip_until;
+}
+
+auto Upstream::rto() const -> Clock::duration {
+    // A failing upstream is only probed, so its doubled RTT does not hold
+    // the client any longer than the shortest wait.
+    if (this->penalized) {
+        return UPSTREAM_MIN_RTO;
+    }
+    return std::clamp<Clock::duration>(this->srtt * 4, UPSTREAM_MIN_RTO,
+                                       UPSTREAM_MAX_RTO);
+}
+
+auto Upstream::succeed(std::chrono::nanoseconds rtt) -> void {
+    // After a failure the doubled RTT says nothing about how fast the
+    // upstream is now, so the new sample replaces it.
+    if (this->penalized || this->srtt.count() == 0) {
+        this->srtt = rtt;
+        this->penalized = false;
+    } else {
+        this->srtt += (rtt - this->srtt) / 8;
+    }
+
+    bool was_down = this->error_rate >= UPSTREAM_MAX_ERROR_RATE;
+    this->error_rate -= this->error_rate / 8;
+    if (was_down && this->error_rate < UPSTREAM_MAX_ERROR_RATE) {
+        spdlog::info("Upstream {} is answering again", address_of(this->addr));
+    }
+}
+
+auto Upstream::fail(Clock::time_point now) -> void {
+    this->srtt = std::clamp<std::chrono::nanoseconds>(
+        this->srtt * 2, UPSTREAM_MIN_RTO, FORWARD_TIMEOUT);
+    this->penalized = true;
+
+    bool was_down = this->error_rate >= UPSTREAM_MAX_ERROR_RATE;
+    this->error_rate += (1 - this->error_rate) / 8;
+    if (this->error_rate >= UPSTREAM_MAX_ERROR_RATE) {
+        this->skip_until = now + UPSTREAM_RETRY;
+        if (!was_down) {
+            spdlog::warn("Upstream {} stops answering, fail over",
+                         address_of(this->addr));
+        }
+    }
+}
+
+auto Forwarder::submit(const PacketView& query, const Client& client)
+    -> std::optional<ErrorMessage> {
+    if (client.stream != 0) {
+        return this->start_stream(query, Waiter{query.header, client, query.edns});
+    }
+    bool sent;
+    return this->start(query, Waiter{query.header, client, query.edns}, sent);
+}
+
+// `sent` tells whether the prefetch went out, or found the same query
+// already out, whose answer will refresh the cache anyway.
+auto Forwarder::prefetch(const PacketView& query, bool& sent)
+    -> std::optional<ErrorMessage> {
+    return this->start(query, std::nullopt, sent);
+}
+
+// Sends `query` upstream for `waiter`, or joins it to the same query
+// already out; `sent` tells which. A prefetch has nothing to join.
+auto Forwarder::start(const PacketView& query, std::optional<Waiter> waiter,
+                      bool& sent) -> std::optional<ErrorMessage> {
+    sent = false;
+    // Everything but the ID must agree: the flags and any OPT record decide
+    // what the answer may hold, and the name is echoed back in its case.
+    std::string key(reinterpret_cast<const char*>(query.data) + 2,
+                    query.len - 2);
+    auto joined = this->in_flight.find(key);
+    if (joined != this->in_flight.end()) {
+        auto& waiters = this->pending.at(joined->second).waiters;
+        if (!waiter) {
+            return {};
+        }
+        if (waiters.size() < MAX_COALESCED) {
+            waiters.push_back(*waiter);
+            this->metrics->coalesced.add();
+            return {};
+        }
+    }
+
+    auto id = this->allocate_id();
+    if (!id) {
+        return "too many pending queries";
+    }
+
+    auto now = Clock::now();
+    PendingQuery entry{
+        .query = Query{std::string(query.qname()), query.qtype, query.qclass},
+        .waiters = {},
+        .key = key,
+        .deadline = now + FORWARD_TIMEOUT,
+        .wire = {query.data,
+                 query.data + std::min<size_t>(query.len, PACKET_SIZE)},
+    };
+
+    if (waiter) {
+        entry.waiters.push_back(*waiter);
+    }
+
+    uint16_t net_id = htons(*id);
+    std::copy_n(reinterpret_cast<uint8_t*>(&net_id), sizeof(net_id),
+                entry.wire.begin());
+
+    size_t upstream = this->select(now, NO_UPSTREAM);
+    if (++this->n_submitted % UPSTREAM_EXPLORE == 0) {
+        std::uniform_int_distribution<size_t> dist(
+            0, this->upstreams.size() - 1);
+        size_t other = dist(this->rng);
+        if (this->upstreams[other].healthy(now)) {
+            upstream = other;
+        }
+    }
+
+    // A connected socket reports an earlier ICMP error on the next send,
+    // so a dead upstream can be skipped at once.
+    std::optional<ErrorMessage> error;
+    for (size_t i = 0; i < this->upstreams.size(); i++) {
+        error = this->transmit(entry, upstream, now);
+        if (!error) {
+            this->pending[*id] = std::move(entry);
+            this->in_flight[std::move(key)] = *id;
+            sent = true;
+            return {};
+        }
+        this->upstreams[upstream].fail(now);
+        upstream = this->select(now, upstream);
+    }
+    return error;
+}
+
+// Connects to the fastest healthy upstream and queues the framed query,
+// which goes out once the connection is writable. An upstream's health is
+// left to its datagram traffic, as a TCP round trip includes the handshake.
+auto Forwarder::start_stream(const PacketView& query, const Waiter& waiter)
+    -> std::optional<ErrorMessage> {
+    std::string key(reinterpret_cast<const char*>(query.data) + 2,
+                    query.len - 2);
+    auto joined = this->streams_in_flight.find(key);
+    if (joined != this->streams_in_flight.end()) {
+        auto& waiters = this->streams.at(joined->second).waiters;
+        if (waiters.size() < MAX_COALESCED) {
+            waiters.push_back(waiter);
+            this->metrics->coalesced.add();
+            return {};
+        }
+    }
+
+    if (this->epoll_fd < 0 || this->streams.size() >= MAX_UPSTREAM_STREAMS) {
+        return "too many upstream TCP queries";
+    }
+
+    auto now = Clock::now();
+    const auto& addr = this->upstreams[this->select(now, NO_UPSTREAM)].addr;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    IPPROTO_TCP);
+    if (fd < 0) {
+        return strerror(errno);
+    }
+    if (connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) <
+            0 &&
+        errno != EINPROGRESS) {
+        ErrorMessage error = strerror(errno);
+        ::close(fd);
+        return error;
+    }
+
+    uint64_t id = EPOLL_UPSTREAM_STREAM | this->next_stream++;
+    epoll_event event{.events = EPOLLOUT, .data = {.u64 = id}};
+    if (epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        ErrorMessage error = strerror(errno);
+        ::close(fd);
+        return error;
+    }
+
+    UpstreamStream entry{
+        .fd = fd,
+        .query = Query{std::string(query.qname()), query.qtype, query.qclass},
+        .waiters = {waiter},
+        .key = key,
+        .deadline = now + FORWARD_TIMEOUT,
+    };
+    uint16_t prefix = htons(query.len);
+    auto bytes = reinterpret_cast<const uint8_t*>(&prefix);
+    entry.out.insert(entry.out.end(), bytes, bytes + sizeof(prefix));
+    entry.out.insert(entry.out.end(), query.data, query.data + query.len);
+
+    this->streams.emplace(id, std::move(entry));
+    this->streams_in_flight[std::move(key)] = id;
+    return {};
+}
+
+// Moves the exchange `id` along. Returns its waiters, with the answer in
+// `answer`, once the whole answer is in; a connection that fails is closed
+// and left to expire().
+auto Forwarder::stream_ready(uint64_t id, uint32_t events,
+                             std::vector<uint8_t>& answer)
+    -> std::optional<std::vector<Waiter>> {
+    auto it = this->streams.find(id);
+    if (it == this->streams.end() || it->second.fd < 0) {
+        return {};
+    }
+    auto& entry = it->second;
+
+    bool alive = !(events & EPOLLERR);
+    bool writing = entry.sent < entry.out.size();
+    while (alive && entry.sent < entry.out.size()) {
+        ssize_t ret = ::send(entry.fd, entry.out.data() + entry.sent,
+                             entry.out.size() - entry.sent, MSG_NOSIGNAL);
+        if (ret < 0) {
+            alive = errno == EAGAIN || errno == EWOULDBLOCK;
+            break;
+        }
+        entry.sent += ret;
+    }
+
+    if (alive && writing && entry.sent == entry.out.size()) {
+        epoll_event event{.events = EPOLLIN, .data = {.u64 = id}};
+        epoll_ctl(this->epoll_fd, EPOLL_CTL_MOD, entry.fd, &event);
+    }
+
+    uint8_t buf[4096];
+    while (alive && !writing && (events & (EPOLLIN | EPOLLHUP))) {
+        ssize_t ret = ::read(entry.fd, buf, sizeof(buf));
+        if (ret < 0) {
+            alive = errno == EAGAIN || errno == EWOULDBLOCK;
+            break;
+        }
+        // The answer must be complete before the upstream closes.
+        alive = ret > 0;
+        entry.in.insert(entry.in.end(), buf, buf + ret);
+
+        if (entry.in.size() < sizeof(uint16_t)) {
+            continue;
+        }
+        size_t len = entry.in[0] << 8 | entry.in[1];
+        if (entry.in.size() - sizeof(uint16_t) < len) {
+            continue;
+        }
+
+        // Only this query was sent on the connection, so the ID is enough.
+        const uint8_t* reply = entry.in.data() + sizeof(uint16_t);
+        if (len < sizeof(Header) ||
+            !std::equal(reply, reply + 2, entry.out.data() + 2)) {
+            spdlog::debug("Drop upstream TCP reply with mismatched ID");
+            alive = false;
+            break;
+        }
+
+        answer.assign(reply, reply + len);
+        auto waiters = std::move(entry.waiters);
+        this->close_stream(id, entry);
+        this->streams.erase(it);
+        return waiters;
+    }
+
+    if (!alive) {
+        spdlog::debug("Upstream TCP query for {} failed", entry.query.qname);
+        this->close_stream(id, entry);
+        entry.deadline = Clock::time_point{};
+    }
+    return {};
+}
+
+// Stops listening on an exchange's connection; later queries start a new
+// one rather than join it.
+auto Forwarder::close_stream(uint64_t id, UpstreamStream& entry) -> void {
+    epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, entry.fd, nullptr);
+    ::close(entry.fd);
+    entry.fd = -1;
+
+    auto joined = this->streams_in_flight.find(entry.key);
+    if (joined != this->streams_in_flight.end() && joined->second == id) {
+        this->streams_in_flight.erase(joined);
+    }
+}
+
+auto Forwarder::receive(size_t upstream, uint8_t* out, size_t size)
+    -> std::optional<std::pair<size_t, std::vector<Waiter>>> {
+    int sock = this->upstreams[upstream].sock;
+    while (true) {
+        int ret = recv(sock, out, size, MSG_DONTWAIT);
+
+        if (ret < 0) {
+            if (errno == ECONNREFUSED) {
+                this->refused(upstream);
+                continue;
+            }
+            return {};
+        }
+
+        if (auto waiters = this->match(upstream, out, ret)) {
+            return std::pair{static_cast<size_t>(ret), std::move(*waiters)};
+        }
+    }
+}
+
+// Only replies on the sockets connected to the upstreams get here, so the
+// kernel has already checked where they came from. The answer to a prefetch
+// matches with no waiters. Some upstreams leave the question out of a
+// FORMERR or NOTIMP, so an error without one matches by ID alone.
+auto Forwarder::match(size_t upstream, const uint8_t* data, size_t len)
+    -> std::optional<std::vector<Waiter>> {
+    if (len < sizeof(Header)) {
+        return {};
+    }
+
+    Header header = Header::from_network(data);
+    uint16_t id = header.dns_id;
+    auto entry = this->pending.find(id);
+
+    if (entry == this->pending.end()) {
+        spdlog::debug("Drop unsolicited upstream reply {}", id);
+        return {};
+    }
+
+    if (header.dns_qdcount != 0 || header.dns_rcode == 0) {
+        auto reply = PacketView::parse(data, len);
+        if (!reply) {
+            return {};
+        }
+
+        const auto& expected = entry->second.query;
+        if (reply->qname() != expected.qname ||
+            reply->qtype != expected.qtype ||
+            reply->qclass != expected.qclass) {
+            spdlog::debug("Drop upstream reply with mismatched question");
+            return {};
+        }
+    }
+
+    // A late answer to an earlier attempt still serves the client, but it
+    // says nothing about the RTT of the upstream last tried.
+    if (upstream == entry->second.upstream) {
+        auto rtt = Clock::now() - entry->second.sent;
+        this->metrics->upstream_rtt.record(rtt);
+        this->upstreams[upstream].succeed(rtt);
+    }
+
+    auto waiters = std::move(entry->second.waiters);
+    this->retire(entry);
+    return waiters;
+}
+
+// The upstream's port is closed: a connected socket learns so from the
+// ICMP error, and its pending queries are tried elsewhere at the next
+// expiry instead of waiting out their RTO. The refusal counts as one
+// failure, however many queries it sends elsewhere.
+auto Forwarder::refused(size_t upstream) -> void {
+    auto now = Clock::now();
+    this->upstreams[upstream].fail(now);
+    for (auto& [id, entry] : this->pending) {
+        if (entry.upstream == upstream) {
+            entry.retry_at = now;
+            entry.refused = true;
+        }
+    }
+}
+
+auto Forwarder::expire(Clock::time_point now)
+    -> std::vector<std::pair<Packet, Waiter>> {
+    std::vector<std::pair<Packet, Waiter>> failed;
+
+    for (auto it = this->pending.begin(); it != this->pending.end();) {
+        auto& entry = it->second;
+        if (entry.retry_at > now) {
+            it++;
+            continue;
+        }
+
+        if (!entry.refused) {
+            this->upstreams[entry.upstream].fail(now);
+            this->metrics->upstream_timeouts.add();
+        }
+
+        if (now < entry.deadline &&
+            !this->transmit(entry, this->select(now, entry.upstream), now)) {
+            this->metrics->upstream_retries.add();
+            it++;
+            continue;
+        }
+
+        spdlog::warn("Upstream timeout for {}", entry.query.qname);
+
+        for (const auto& waiter : entry.waiters) {
+            if (auto packet = servfail(entry.query, waiter)) {
+                failed.emplace_back(std::move(*packet), waiter);
+            }
+        }
+        it = this->retire(it);
+    }
+
+    for (auto it = this->streams.begin(); it != this->streams.end();) {
+        auto& entry = it->second;
+        if (entry.deadline > now) {
+            it++;
+            continue;
+        }
+
+        if (entry.fd >= 0) {
+            spdlog::warn("Upstream TCP timeout for {}", entry.query.qname);
+            this->close_stream(it->first, entry);
+        }
+        for (const auto& waiter : entry.waiters) {
+            if (auto packet = servfail(entry.query, waiter)) {
+                failed.emplace_back(std::move(*packet), waiter);
+            }
+        }
+        it = this->streams.erase(it);
+    }
+
+    return failed;
+}
+
+// Forgets a query once it is answered or given up on. Its key may already
+// name a newer query that started when this one was full.
+auto Forwarder::retire(std::unordered_map<uint16_t, PendingQuery>::iterator
+                           entry)
+    -> std::unordered_map<uint16_t, PendingQuery>::iterator {
+    auto joined = this->in_flight.find(entry->second.key);
+    if (joined != this->in_flight.end() && joined->second == entry->first) {
+        this->in_flight.erase(joined);
+    }
+    return this->pending.erase(entry);
+}
+
+auto Forwarder::has_pending() const -> bool {
+    return !this->pending.empty() || !this->streams.empty();
+}
+
+auto Forwarder::allocate_id() -> std::optional<uint16_t> {
+    if (this->pending.size() > UINT16_MAX) {
+        return {};
+    }
+
+    std::uniform_int_distribution<uint16_t> dist;
+    while (true) {
+        uint16_t id = dist(this->rng);
+        if (this->pending.find(id) == this->pending.end()) {
+            return id;
+        }
+    }
+}
+
+// The healthy upstream with the lowest RTT, other than `exclude` when there
+// is a choice. If every upstream is failing, the least failing one is used,
+// so queries still go out and one that recovers is found again.
+auto Forwarder::select(Clock::time_point now, size_t exclude) -> size_t {
+    size_t best = NO_UPSTREAM, fallback = NO_UPSTREAM;
+    for (size_t i = 0; i < this->upstreams.size(); i++) {
+        if (i == exclude && this->upstreams.size() > 1) {
+            continue;
+        }
+        const auto& upstream = this->upstreams[i];
+        if (fallback == NO_UPSTREAM ||
+            upstream.error_rate < this->upstreams[fallback].error_rate) {
+            fallback = i;
+        }
+        if (upstream.healthy(now) &&
+            (best == NO_UPSTREAM ||
+             upstream.srtt < this->upstreams[best].srtt)) {
+            best = i;
+        }
+    }
+    return best != NO_UPSTREAM ? best : fallback;
+}
+
+auto Forwarder::transmit(PendingQuery& entry, size_t upstream,
+                         Clock::time_point now)
+    -> std::optional<ErrorMessage> {
+    if (::send(this->upstreams[upstream].sock, entry.wire.data(),
+               entry.wire.size(), 0) < 0) {
+        return strerror(errno);
+    }
+
+    entry.upstream = upstream;
+    entry.refused = false;
+    entry.sent = now;
+    entry.retry_at =
+        std::min(now + this->upstreams[upstream].rto(), entry.deadline);
+    return {};
+}
@@ -0,0 +1,326 @@
+#include "image.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <vector>
+
+#include "spdlog/spdlog.h"
+
+// FNV-1a is used for both the checksum and the bucket hash because, unlike
+// std::hash, it is the same in the compiler and in every server build.
+static auto fnv1a(const uint8_t* data, size_t len,
+                  uint64_t hash = 0xcbf29ce484222325ULL) -> uint64_t {
+    for (size_t i = 0; i < len; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static auto entry_hash(std::string_view name, uint16_t qtype) -> uint64_t {
+    uint64_t hash =
+        fnv1a(reinterpret_cast<const uint8_t*>(name.data()), name.size());
+    return fnv1a(reinterpret_cast<const uint8_t*>(&qtype), sizeof(qtype),
+                 hash);
+}
+
+static auto zone_key(std::string_view name) -> std::string_view {
+    if (!name.empty() && name.back() == '.') {
+        name.remove_suffix(1);
+    }
+    return name;
+}
+
+ZoneImage::~ZoneImage() {
+    if (this->base != nullptr) {
+        munmap(const_cast<uint8_t*>(this->base), this->length);
+    }
+}
+
+auto ZoneImage::is_image(const fs::path& path) -> bool {
+    std::ifstream ifs(path, std::ios::binary);
+    char magic[sizeof(IMAGE_MAGIC)]{};
+    ifs.read(magic, sizeof(magic));
+    return ifs && std::memcmp(magic, IMAGE_MAGIC, sizeof(magic)) == 0;
+}
+
+auto ZoneImage::open(const fs::path& path) -> std::shared_ptr<ZoneImage> {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        spdlog::error("Fail to open zone image {}: {}", path.string(),
+                      strerror(errno));
+        return nullptr;
+    }
+
+    struct stat st {};
+    if (fstat(fd, &st) < 0 ||
+        static_cast<size_t>(st.st_size) < sizeof(ImageHeader)) {
+        spdlog::error("Zone image {} is truncated", path.string());
+        close(fd);
+        return nullptr;
+    }
+
+    void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        spdlog::error("Fail to map zone image {}: {}", path.string(),
+                      strerror(errno));
+        return nullptr;
+    }
+
+    std::shared_ptr<ZoneImage> image(new ZoneImage());
+    image->base = static_cast<const uint8_t*>(addr);
+    image->length = st.st_size;
+    image->header = reinterpret_cast<const ImageHeader*>(image->base);
+
+    const ImageHeader& header = *image->header;
+    if (std::memcmp(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0 ||
+        header.version != IMAGE_VERSION) {
+        spdlog::error("{} is not a version {} zone image", path.string(),
+                      IMAGE_VERSION);
+        return nullptr;
+    }
+
+    if (header.size != image->length ||
+        header.buckets + header.n_buckets * sizeof(uint32_t) > header.size ||
+        header.entries + header.n_entries * sizeof(ImageEntry) >
+            header.size ||
+        header.forward + header.forward_len > header.size ||
+        header.n_buckets == 0 ||
+        (header.n_buckets & (header.n_buckets - 1)) != 0) {
+        spdlog::error("Zone image {} is malformed", path.string());
+        return nullptr;
+    }
+
+    uint64_t checksum = fnv1a(image->base + sizeof(ImageHeader),
+                              image->length - sizeof(ImageHeader));
+    if (checksum != header.checksum) {
+        spdlog::error("Zone image {} fails its checksum", path.string());
+        return nullptr;
+    }
+
+    image->buckets =
+        reinterpret_cast<const uint32_t*>(image->base + header.buckets);
+    image->entries =
+        reinterpret_cast<const ImageEntry*>(image->base + header.entries);
+
+    spdlog::info("Mapped {} entries from {}", header.n_entries, path.string());
+    return image;
+}
+
+auto ZoneImage::write(const fs::path& path, const std::string& forward_ip,
+                      const AnswerTable& table) -> bool {
+    std::map<std::string_view, const Answer*> missing;
+    for (const auto& answer : table.entries()) {
+        if (answer.qtype == 0) {
+            missing.emplace(answer.owner, &answer);
+        }
+    }
+
+    std::vector<ImageEntry> entries;
+    std::vector<uint8_t> blob;
+
+    auto append = [&blob](const void* data, size_t len) {
+        auto bytes = static_cast<const uint8_t*>(data);
+        if (blob.size() % alignof(uint16_t) != 0) {
+            blob.push_back(0);
+        }
+        size_t offset = blob.size();
+        blob.insert(blob.end(), bytes, bytes + len);
+        return offset;
+    };
+
+    // Blob offsets are relative until the layout is known.
+    auto add = [&](std::string_view name, uint16_t qtype,
+                   const Answer* answer) {
+        ImageEntry entry{
+            .hash = entry_hash(name, qtype),
+            .name = append(name.data(), name.size()),
+            .name_len = static_cast<uint32_t>(name.size()),
+            .qtype = qtype,
+        };
+
+        if (answer != nullptr) {
+            entry.flags = IMAGE_HAS_ANSWER;
+            entry.ancount = answer->ancount;
+            entry.nscount = answer->nscount;
+            entry.arcount = answer->arcount;
+            entry.question_end = answer->question_end;
+            entry.sections =
+                append(answer->sections.data(), answer->sections.size());
+            entry.sections_len = answer->sections.size();
+            entry.pointers =
+                append(answer->pointers.data(),
+                       answer->pointers.size() * sizeof(uint16_t));
+            entry.n_pointers = answer->pointers.size();
+        }
+        entries.push_back(entry);
+    };
+
+    for (const auto& domain : table.domains()) {
+        auto it = missing.find(domain);
+        add(zone_key(domain), 0,
+            it == missing.end() ? nullptr : it->second);
+    }
+
+    for (const auto& answer : table.entries()) {
+        if (answer.qtype != 0) {
+            add(answer.owner, answer.qtype, &answer);
+        }
+    }
+
+    uint32_t n_buckets = 1;
+    while (n_buckets < entries.size() * 2) {
+        n_buckets <<= 1;
+    }
+
+    ImageHeader header{
+        .version = IMAGE_VERSION,
+        .n_entries = static_cast<uint32_t>(entries.size()),
+        .n_buckets = n_buckets,
+        .forward_len = static_cast<uint32_t>(forward_ip.size()),
+    };
+    std::memcpy(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+
+    header.buckets = sizeof(ImageHeader);
+    header.entries = header.buckets + n_buckets * sizeof(uint32_t);
+    constexpr size_t align = alignof(ImageEntry);
+    header.entries += (align - header.entries % align) % align;
+    uint64_t blob_base = header.entries + entries.size() * sizeof(ImageEntry);
+    header.forward =
+        blob_base + append(forward_ip.data(), forward_ip.size());
+    header.size = blob_base + blob.size();
+
+    std::vector<uint32_t> buckets(n_buckets, IMAGE_EMPTY_BUCKET);
+    for (uint32_t i = 0; i < entries.size(); i++) {
+        auto& entry = entries[i];
+        entry.name += blob_base;
+        entry.sections += blob_base;
+        entry.pointers += blob_base;
+
+        size_t slot = entry.hash & (n_buckets - 1);
+        while (buckets[slot] != IMAGE_EMPTY_BUCKET) {
+            slot = (slot + 1) & (n_buckets - 1);
+        }
+        buckets[slot] = i;
+    }
+
+    std::vector<uint8_t> image(header.size);
+    std::memcpy(image.data() + header.buckets, buckets.data(),
+                buckets.size() * sizeof(uint32_t));
+    std::memcpy(image.data() + header.entries, entries.data(),
+                entries.size() * sizeof(ImageEntry));
+    std::memcpy(image.data() + blob_base, blob.data(), blob.size());
+    header.checksum = fnv1a(image.data() + sizeof(ImageHeader),
+                            image.size() - sizeof(ImageHeader));
+    std::memcpy(image.data(), &header, sizeof(header));
+
+    // Write beside the target and rename, so a running server never maps a
+    // half-written image.
+    fs::path tmp_path = path;
+    tmp_path += ".tmp";
+
+    std::ofstream ofs(tmp_path, std::ios::binary | std::ios::trunc);
+    ofs.write(reinterpret_cast<const char*>(image.data()), image.size());
+    ofs.close();
+
+    std::error_code ec;
+    if (!ofs || (fs::rename(tmp_path, path, ec), ec)) {
+        spdlog::error("Fail to write zone image {}", path.string());
+        return false;
+    }
+
+    spdlog::info("Wrote {} entries ({} bytes) to {}", entries.size(),
+                 image.size(), path.string());
+    return true;
+}
+
+auto ZoneImage::forward_ip() const -> std::string_view {
+    return std::string_view(
+        reinterpret_cast<const char*>(this->base + this->header->forward),
+        this->header->forward_len);
+}
+
+auto ZoneImage::size() const -> size_t { return this->header->n_entries; }
+
+auto ZoneImage::find_zone(std::string_view qname) const
+    -> std::optional<std::string_view> {
+    std::string_view name = zone_key(qname);
+
+    // Probe from the longest suffix so the closest enclosing zone wins.
+    while (true) {
+        if (this->lookup(name, 0) != nullptr) {
+            return name;
+        }
+        if (name.empty()) {
+            return {};
+        }
+
+        size_t dot = name.find('.');
+        name = dot == std::string_view::npos ? std::string_view()
+                                             : name.substr(dot + 1);
+    }
+}
+
+auto ZoneImage::find(std::string_view qname, uint16_t qtype) const
+    -> std::optional<AnswerView> {
+    if (qtype == 0) {
+        return {};
+    }
+
+    auto entry = this->lookup(qname, qtype);
+    if (entry == nullptr) {
+        return {};
+    }
+    return this->view(*entry);
+}
+
+auto ZoneImage::find_missing(std::string_view domain) const
+    -> std::optional<AnswerView> {
+    auto entry = this->lookup(zone_key(domain), 0);
+    if (entry == nullptr || !(entry->flags & IMAGE_HAS_ANSWER)) {
+        return {};
+    }
+    return this->view(*entry);
+}
+
+auto ZoneImage::lookup(std::string_view name, uint16_t qtype) const
+    -> const ImageEntry* {
+    uint64_t hash = entry_hash(name, qtype);
+    uint32_t mask = this->header->n_buckets - 1;
+
+    for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+        uint32_t index = this->buckets[slot];
+        if (index == IMAGE_EMPTY_BUCKET) {
+            return nullptr;
+        }
+
+        const auto& entry = this->entries[index];
+        if (entry.hash == hash && entry.qtype == qtype &&
+            std::string_view(
+                reinterpret_cast<const char*>(this->base + entry.name),
+                entry.name_len) == name) {
+            return &entry;
+        }
+    }
+}
+
+auto ZoneImage::view(const ImageEntry& entry) const -> AnswerView {
+    return AnswerView{
+        .ancount = entry.ancount,
+        .nscount = entry.nscount,
+        .arcount = entry.arcount,
+        .question_end = entry.question_end,
+        .sections = this->base + entry.sections,
+        .sections_len = entry.sections_len,
+        .pointers =
+            reinterpret_cast<const uint16_t*>(this->base + entry.pointers),
+        .n_pointers = entry.n_pointers,
+    };
+}
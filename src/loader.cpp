@@ -0,0 +1,164 @@
+#include "loader.hpp"
+
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <thread>
+
+#include "builder.hpp"
+#include "forwarder.hpp"
+#include "image.hpp"
+#include "spdlog/spdlog.h"
+#include "util.hpp"
+
+auto ZoneLoader::load() const -> std::unique_ptr<Snapshot> {
+    if (ZoneImage::is_image(this->path)) {
+        return this->load_image();
+    }
+    return this->load_config();
+}
+
+auto ZoneLoader::load_image() const -> std::unique_ptr<Snapshot> {
+    auto image = ZoneImage::open(this->path);
+    if (!image) {
+        return nullptr;
+    }
+
+    auto snapshot = std::make_unique<Snapshot>();
+    snapshot->forward_ip = image->forward_ip();
+    snapshot->answers = std::move(image);
+    return snapshot;
+}
+
+auto ZoneLoader::load_config() const -> std::unique_ptr<Snapshot> {
+    std::ifstream ifs(this->path);
+    if (!ifs.is_open()) {
+        spdlog::error("Fail to open config file {}: {}", this->path.string(),
+                      strerror(errno));
+        return nullptr;
+    }
+
+    spdlog::info("Reading config file {}", this->path.string());
+
+    auto snapshot = std::make_unique<Snapshot>();
+    if (!std::getline(ifs, snapshot->forward_ip)) {
+        spdlog::error("Fail to get forward ip");
+        return nullptr;
+    }
+
+    snapshot->forward_ip = trim(snapshot->forward_ip);
+
+    std::vector<fs::path> zone_paths;
+    std::string line;
+    while (std::getline(ifs, line)) {
+        auto split_line = split(line, ',');
+        if (split_line.size() < 2) {
+            spdlog::error("Config file format incorrect: {}", line);
+            return nullptr;
+        }
+
+        zone_paths.push_back(this->path.parent_path() / split_line[1]);
+    }
+
+    auto collection = std::make_shared<Collection>();
+    auto start = Clock::now();
+    std::vector<ZoneFile> zones(zone_paths.size());
+    std::atomic<size_t> next{0};
+
+    auto load = [&] {
+        for (size_t i = next++; i < zone_paths.size(); i = next++) {
+            zones[i] = load_zone(zone_paths[i]);
+        }
+    };
+
+    std::vector<std::thread> loaders;
+    size_t n_loaders = std::min(this->n_threads, zone_paths.size());
+    for (size_t i = 1; i < n_loaders; i++) {
+        loaders.emplace_back(load);
+    }
+    load();
+    for (auto& loader : loaders) {
+        loader.join();
+    }
+
+    // Merge in config order, so records, zones and errors come out the
+    // same however the files were spread over the loaders.
+    size_t n_records = 0;
+    for (auto& zone : zones) {
+        spdlog::info("Reading zone file {}", zone.path.string());
+        for (const auto& warning : zone.warnings) {
+            spdlog::warn("Invalid record: {}", warning);
+        }
+
+        if (zone.error) {
+            spdlog::error("{}", *zone.error);
+            return nullptr;
+        }
+
+        for (const auto& record : zone.records) {
+            collection->add_record(zone.domain, record);
+        }
+        n_records += zone.records.size();
+    }
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        Clock::now() - start);
+    spdlog::info("Loaded {} records from {} zones with {} threads in {} ms",
+                 n_records, zones.size(), std::max<size_t>(n_loaders, 1),
+                 elapsed.count());
+    snapshot->collection = std::move(collection);
+    return snapshot;
+}
+
+auto ZoneLoader::load_zone(const fs::path& zone_path) -> ZoneFile {
+    ZoneFile zone{.path = zone_path};
+
+    std::ifstream ifs(zone_path);
+    if (!ifs.is_open()) {
+        zone.error = "Fail to open zone file " + zone_path.string() + ": " +
+                     strerror(errno);
+        return zone;
+    }
+
+    std::string line;
+    if (!std::getline(ifs, zone.domain)) {
+        zone.error = "Fail to get domain from " + zone_path.string();
+        return zone;
+    }
+
+    zone.domain = trim(zone.domain);
+
+    while (std::getline(ifs, line)) {
+        auto slices = split(line, ',');
+
+        if (slices.size() < 5) {
+            zone.warnings.push_back(line);
+            continue;
+        }
+
+        // This runs on a loader thread, and on reload inside the running
+        // server, so a field the builder can't parse must not escape.
+        std::optional<Record> r;
+        try {
+            r = RecordBuilder()
+                    .set_name(slices[0])
+                    .set_ttl(slices[1])
+                    .set_class(slices[2])
+                    .set_type(slices[3])
+                    .set_rdata(split(slices[4]))
+                    .build();
+        } catch (const std::exception&) {
+        }
+
+        if (!r) {
+            zone.error = "Invalid record in " + zone_path.string() + ": " +
+                         line;
+            return zone;
+        }
+
+        zone.records.push_back(std::move(*r));
+    }
+
+    return zone;
+}
+
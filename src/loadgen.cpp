@@ -0,0 +1,269 @@
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <charconv>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <thread>
+
+#include "builder.hpp"
+#include "forwarder.hpp"
+#include "metrics.hpp"
+#include "packet.hpp"
+#include "server.hpp"
+#include "spdlog/spdlog.h"
+#include "util.hpp"
+
+constexpr auto QUERY_TIMEOUT = std::chrono::seconds(1);
+constexpr auto SWEEP_INTERVAL = std::chrono::milliseconds(100);
+constexpr size_t MAX_OUTSTANDING = UINT16_MAX;
+
+// Reads "name type" lines, as dnsperf does, into wire-format questions.
+static auto read_queries(const fs::path& path)
+    -> std::vector<std::vector<uint8_t>> {
+    static const std::map<std::string, uint16_t> types = {
+        {"A", Record::A},     {"NS", Record::NS},   {"CNAME", Record::CNAME},
+        {"SOA", Record::SOA}, {"MX", Record::MX},   {"TXT", Record::TXT},
+        {"AAAA", Record::AAAA},
+    };
+
+    std::ifstream ifs(path);
+    if (!ifs) {
+        err_quit("Fail to open query file");
+    }
+
+    std::vector<std::vector<uint8_t>> queries;
+    std::string line;
+    while (std::getline(ifs, line)) {
+        std::istringstream fields(line);
+        std::string name, type = "A";
+        if (!(fields >> name) || name[0] == '#') {
+            continue;
+        }
+        fields >> type;
+
+        uint16_t qtype;
+        auto known = types.find(type);
+        if (known != types.end()) {
+            qtype = known->second;
+        } else {
+            const char* end = type.data() + type.size();
+            auto [ptr, ec] = std::from_chars(type.data(), end, qtype);
+            if (ec != std::errc() || ptr != end) {
+                spdlog::warn("Skip query of unknown type: {}", line);
+                continue;
+            }
+        }
+
+        Header header{};
+        header.dns_rd = 1;
+        header.dns_qdcount = 1;
+        header = Header::to_response(header);
+
+        std::vector<uint8_t> query(sizeof(header));
+        std::copy_n(reinterpret_cast<uint8_t*>(&header), sizeof(header),
+                    query.begin());
+        auto qname = compress_domain(name);
+        query.insert(query.end(), qname.begin(), qname.end());
+        uint16_t tail[] = {htons(qtype), htons(Record::IN)};
+        auto bytes = reinterpret_cast<uint8_t*>(tail);
+        query.insert(query.end(), bytes, bytes + sizeof(tail));
+        queries.push_back(std::move(query));
+    }
+
+    if (queries.empty()) {
+        spdlog::error("No queries in {}", path.string());
+        exit(EXIT_FAILURE);
+    }
+    return queries;
+}
+
+// Answers every query on `sin` with one A record, so the forwarding path
+// can be measured without a network. A TTL of 0 keeps the answers out of
+// the server's cache.
+static auto fake_upstream(sockaddr_in sin, uint32_t ttl) -> void {
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0 || bind(sock, (sockaddr*)&sin, sizeof(sin)) < 0) {
+        err_quit("Fail to bind fake upstream");
+    }
+
+    uint8_t buf[PACKET_SIZE];
+    while (true) {
+        sockaddr_in client{};
+        socklen_t len = sizeof(client);
+        int ret = recvfrom(sock, buf, sizeof(buf), 0, (sockaddr*)&client, &len);
+        if (ret < 0) {
+            continue;
+        }
+
+        auto query = PacketView::parse(buf, ret);
+        if (!query || query->question_end + 16 > sizeof(buf)) {
+            continue;
+        }
+
+        bool answer = query->qtype == Record::A;
+        Header header = query->header;
+        header.dns_qr = 1;
+        header.dns_ra = 1;
+        header.dns_ancount = answer;
+        header.dns_nscount = 0;
+        header.dns_arcount = 0;
+        header = Header::to_response(header);
+        std::copy_n(reinterpret_cast<uint8_t*>(&header), sizeof(header), buf);
+
+        size_t size = query->question_end;
+        if (answer) {
+            uint8_t record[16] = {0xc0, 0x0c, 0, Record::A, 0, Record::IN};
+            uint32_t net_ttl = htonl(ttl);
+            std::copy_n(reinterpret_cast<uint8_t*>(&net_ttl), 4, record + 6);
+            record[11] = 4;
+            record[12] = 127;
+            record[15] = 1;
+            std::copy_n(record, sizeof(record), buf + size);
+            size += sizeof(record);
+        }
+        sendto(sock, buf, size, 0, (sockaddr*)&client, len);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    spdlog::set_level(spdlog::level::info);
+
+    if (argc < 3) {
+        std::cerr << "usage: " << argv[0] << " <port> <query-file>\n"
+                  << "env: SERVER RATE OUTSTANDING DURATION FAKE_UPSTREAM "
+                     "FAKE_TTL\n";
+        exit(EXIT_FAILURE);
+    }
+
+    uint16_t port = std::stoul(argv[1]);
+    auto queries = read_queries(argv[2]);
+    const char* server = getenv("SERVER");
+    size_t rate = env_or("RATE", 0);
+    size_t outstanding =
+        std::clamp<size_t>(env_or("OUTSTANDING", 100), 1, MAX_OUTSTANDING);
+    auto duration = std::chrono::seconds(env_or("DURATION", 10));
+
+    // Takes upstreams as the config does, so an unprivileged port or
+    // several upstreams can stand in for the real ones.
+    if (const char* upstreams = getenv("FAKE_UPSTREAM")) {
+        for (const auto& upstream : parse_upstreams(upstreams)) {
+            std::thread(fake_upstream, upstream, env_or("FAKE_TTL", 0))
+                .detach();
+        }
+    }
+
+    sockaddr_in sin{.sin_family = AF_INET, .sin_port = htons(port)};
+    std::string address = server ? server : "127.0.0.1";
+    if (inet_pton(AF_INET, address.c_str(), &sin.sin_addr) <= 0) {
+        err_quit("Can't convert IPv4 address for " + address);
+    }
+
+    int sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP);
+    if (sock < 0 || connect(sock, (sockaddr*)&sin, sizeof(sin)) < 0) {
+        err_quit("Fail to connect to server");
+    }
+    int buffer = 4 << 20;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+
+    // In-flight queries by ID; IDs are handed out in order, so with fewer
+    // than 65536 outstanding a live ID is never reused.
+    std::vector<Clock::time_point> sent_at(MAX_OUTSTANDING + 1);
+    std::vector<bool> in_flight(MAX_OUTSTANDING + 1);
+    size_t n_flight = 0;
+    uint16_t next_id = 0;
+
+    uint64_t n_sent = 0, n_done = 0, n_lost = 0;
+    std::array<uint64_t, RCODES> rcodes{};
+    Histogram latency;
+
+    auto start = Clock::now();
+    auto stop = start + duration;
+    auto last_sweep = start;
+    uint8_t buf[PACKET_SIZE];
+
+    while (true) {
+        auto now = Clock::now();
+        bool sending = now < stop;
+        if (!sending && n_flight == 0) {
+            break;
+        }
+
+        // Send up to the window, and no faster than RATE if it is set.
+        while (sending && n_flight < outstanding) {
+            if (rate > 0 && now - start < std::chrono::nanoseconds(
+                                              n_sent * 1000000000 / rate)) {
+                break;
+            }
+
+            auto& query = queries[n_sent % queries.size()];
+            uint16_t id = htons(next_id);
+            std::copy_n(reinterpret_cast<uint8_t*>(&id), sizeof(id),
+                        query.begin());
+
+            if (send(sock, query.data(), query.size(), 0) < 0) {
+                break;
+            }
+            sent_at[next_id] = now;
+            in_flight[next_id] = true;
+            next_id++;
+            n_flight++;
+            n_sent++;
+        }
+
+        // Spin while the window is open at full speed; otherwise wait for
+        // answers or the next send slot, at millisecond granularity.
+        bool spin = sending && rate == 0 && n_flight < outstanding;
+        pollfd fds{.fd = sock, .events = POLLIN};
+        poll(&fds, 1, spin ? 0 : 1);
+
+        int len;
+        while ((len = recv(sock, buf, sizeof(buf), 0)) >= 0) {
+            if (static_cast<size_t>(len) < sizeof(Header)) {
+                continue;
+            }
+            Header header = Header::from_network(buf);
+            if (!in_flight[header.dns_id]) {
+                continue;
+            }
+            in_flight[header.dns_id] = false;
+            n_flight--;
+            n_done++;
+            rcodes[header.dns_rcode]++;
+            latency.record(Clock::now() - sent_at[header.dns_id]);
+        }
+
+        now = Clock::now();
+        if (now - last_sweep >= SWEEP_INTERVAL) {
+            for (size_t id = 0; id <= MAX_OUTSTANDING; id++) {
+                if (in_flight[id] && now - sent_at[id] >= QUERY_TIMEOUT) {
+                    in_flight[id] = false;
+                    n_flight--;
+                    n_lost++;
+                }
+            }
+            last_sweep = now;
+        }
+    }
+
+    double seconds = std::chrono::duration<double>(duration).count();
+    std::vector<uint64_t> totals;
+    latency.merge_into(totals);
+
+    std::cout << fmt::format("sent {} completed {} lost {} ({:.2f}%)\n",
+                             n_sent, n_done, n_lost,
+                             n_sent ? 100.0 * n_lost / n_sent : 0.0);
+    std::cout << fmt::format("qps {:.1f}\n", n_done / seconds);
+    for (size_t i = 0; i < RCODES; i++) {
+        if (rcodes[i] > 0) {
+            std::cout << fmt::format("rcode {} {}\n", i, rcodes[i]);
+        }
+    }
+    std::cout << "latency_us " << Histogram::summarize(totals) << "\n";
+
+    return n_done > 0 ? 0 : EXIT_FAILURE;
+}
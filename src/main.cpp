@@ -1,3 +1,6 @@
+#include <string_view>
+#include <thread>
+
 #include "builder.hpp"
 #include "server.hpp"
 #include "spdlog/spdlog.h"
@@ -11,25 +14,46 @@ int main(int argc, char* argv[], char* envp[]) {
     }
 
     auto [port, config_path] = parse_args(argc, argv);
-    auto server =
-        ServerBuilder()
-            .load_config(config_path)
-            .register_fn(Record::Type::A, std::make_shared<ARecordResponder>())
-            .register_fn(Record::Type::NS,
-                         std::make_shared<NSRecordResponder>())
-            .register_fn(Record::Type::MX,
-                         std::make_shared<MXRecordResponder>())
-            .register_fn(Record::Type::SOA,
-                         std::make_shared<SOARecordResponder>())
-            .register_fn(Record::Type::TXT,
-                         std::make_shared<TXTRecordResponder>())
-            .register_fn(Record::Type::AAAA,
-                         std::make_shared<AAAARecordResponder>())
-            .register_fn(Record::Type::CNAME,
-                         std::make_shared<CNAMERecordResponder>())
-
-            .bind(port);
-    spdlog::info("Server bind to port {}\n", port);
+    size_t n_workers = env_or("WORKERS", std::thread::hardware_concurrency());
+    size_t batch_size = env_or("BATCH_SIZE", DEFAULT_BATCH_SIZE);
+    size_t cache_size = env_or("CACHE_SIZE", DEFAULT_CACHE_SIZE);
+    size_t prefetch_percent =
+        env_or("PREFETCH_PERCENT", DEFAULT_PREFETCH_PERCENT);
+    size_t prefetch_hits = env_or("PREFETCH_HITS", DEFAULT_PREFETCH_HITS);
+    size_t edns_size = env_or("EDNS_SIZE", DEFAULT_EDNS_SIZE);
+    size_t tcp_connections =
+        env_or("TCP_CONNECTIONS", DEFAULT_TCP_CONNECTIONS);
+    size_t rrl_rate = env_or("RRL_RATE", 0);
+    size_t rrl_slip = env_or("RRL_SLIP", DEFAULT_RRL_SLIP);
+    size_t n_loaders =
+        env_or("LOAD_THREADS", std::thread::hardware_concurrency());
+
+    const char* backend = getenv("IO_BACKEND");
+    bool uring = backend != nullptr && std::string_view(backend) == "uring";
+
+    const char* stats_socket = getenv("STATS_SOCKET");
+
+    // Dynamic updates are unauthenticated, so only listed hosts may send them.
+    const char* update_allow = getenv("UPDATE_ALLOW");
+
+    auto server = ServerBuilder()
+                      .set_loaders(n_loaders)
+                      .set_update_allow(
+                          split(update_allow ? update_allow : "127.0.0.1", ','))
+                      .load_config(config_path)
+                      .set_workers(n_workers)
+                      .set_batch_size(batch_size)
+                      .set_edns_size(edns_size)
+                      .set_backend(uring ? Backend::Uring : Backend::Syscall)
+                      .set_stats_socket(stats_socket ? stats_socket : "")
+                      .set_cache_size(cache_size)
+                      .set_prefetch(prefetch_percent, prefetch_hits)
+                      .set_tcp_connections(tcp_connections)
+                      .set_rate_limit(rrl_rate, rrl_slip)
+                      .register_defaults()
+                      .bind(port);
+    spdlog::info("Server bind to port {} with {} workers\n", port,
+                 server.workers.size());
 
     server.run();
 
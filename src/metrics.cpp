@@ -0,0 +1,229 @@
+#include "metrics.hpp"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cstring>
+
+#include "spdlog/fmt/fmt.h"
+#include "spdlog/spdlog.h"
+#include "util.hpp"
+
+static constexpr const char* RCODE_NAMES[RCODES] = {
+    "NOERROR", "FORMERR",  "SERVFAIL", "NXDOMAIN", "NOTIMP",  "REFUSED",
+    "YXDOMAIN", "YXRRSET", "NXRRSET",  "NOTAUTH",  "NOTZONE", "RCODE11",
+    "RCODE12", "RCODE13",  "RCODE14",  "RCODE15",
+};
+
+static constexpr const char* DROP_NAMES[] = {
+    "malformed",
+    "forward_failed",
+    "send_failed",
+};
+
+static auto qtype_name(size_t qtype) -> std::string {
+    switch (qtype) {
+        case 1:
+            return "A";
+        case 2:
+            return "NS";
+        case 5:
+            return "CNAME";
+        case 6:
+            return "SOA";
+        case 12:
+            return "PTR";
+        case 15:
+            return "MX";
+        case 16:
+            return "TXT";
+        case 28:
+            return "AAAA";
+        case 33:
+            return "SRV";
+        case 65:
+            return "HTTPS";
+        case 255:
+            return "ANY";
+        case TRACKED_QTYPES:
+            return "OTHER";
+        default:
+            return "TYPE" + std::to_string(qtype);
+    }
+}
+
+auto Histogram::bucket_of(uint64_t value) -> size_t {
+    constexpr uint64_t sub_buckets = 1 << HISTOGRAM_SUB_BITS;
+    if (value < sub_buckets) {
+        return value;
+    }
+
+    unsigned shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    return ((shift + 1) << HISTOGRAM_SUB_BITS) +
+           ((value >> shift) & (sub_buckets - 1));
+}
+
+auto Histogram::upper_bound(size_t bucket) -> uint64_t {
+    constexpr uint64_t sub_buckets = 1 << HISTOGRAM_SUB_BITS;
+    if (bucket < sub_buckets) {
+        return bucket;
+    }
+
+    unsigned shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+    uint64_t step = sub_buckets + (bucket & (sub_buckets - 1));
+    return ((step + 1) << shift) - 1;
+}
+
+auto Histogram::record(std::chrono::nanoseconds elapsed) -> void {
+    this->buckets[bucket_of(std::max<int64_t>(elapsed.count(), 0))].add();
+}
+
+auto Histogram::merge_into(std::vector<uint64_t>& totals) const -> void {
+    totals.resize(HISTOGRAM_BUCKETS);
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        totals[i] += this->buckets[i].load();
+    }
+}
+
+// Formats count, p50, p99, p999 and max of a merged histogram, in
+// microseconds.
+auto Histogram::summarize(const std::vector<uint64_t>& totals)
+    -> std::string {
+    uint64_t count = 0;
+    size_t last = 0;
+    for (size_t i = 0; i < totals.size(); i++) {
+        count += totals[i];
+        last = totals[i] > 0 ? i : last;
+    }
+
+    auto percentile = [&](double q) {
+        auto rank = static_cast<uint64_t>(q * count + 0.5);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < totals.size(); i++) {
+            seen += totals[i];
+            if (seen >= std::max<uint64_t>(rank, 1)) {
+                return upper_bound(i) / 1e3;
+            }
+        }
+        return 0.0;
+    };
+
+    if (count == 0) {
+        return "count 0";
+    }
+    return fmt::format("count {} p50 {:.1f} p99 {:.1f} p999 {:.1f} max {:.1f}",
+                       count, percentile(0.5), percentile(0.99),
+                       percentile(0.999), upper_bound(last) / 1e3);
+}
+
+StatsListener::StatsListener(
+    std::string path, std::vector<std::shared_ptr<WorkerMetrics>> workers)
+    : path(std::move(path)), workers(std::move(workers)) {}
+
+auto StatsListener::run() -> void {
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        err_quit("Fail to build stats socket");
+    }
+
+    sockaddr_un addr{.sun_family = AF_UNIX};
+    if (this->path.size() >= sizeof(addr.sun_path)) {
+        spdlog::error("Stats socket path {} is too long", this->path);
+        return;
+    }
+    std::strcpy(addr.sun_path, this->path.c_str());
+
+    // A socket left by an earlier run would make bind fail.
+    unlink(this->path.c_str());
+    if (bind(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+        listen(sock, SOMAXCONN) < 0) {
+        err_quit("Fail to listen on stats socket");
+    }
+    spdlog::info("Serving stats on {}", this->path);
+
+    while (true) {
+        int client = accept4(sock, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0) {
+            continue;
+        }
+
+        std::string text = this->report();
+        for (size_t sent = 0; sent < text.size();) {
+            ssize_t ret = send(client, text.data() + sent, text.size() - sent,
+                               MSG_NOSIGNAL);
+            if (ret <= 0) {
+                break;
+            }
+            sent += ret;
+        }
+        close(client);
+    }
+}
+
+auto StatsListener::report() const -> std::string {
+    std::array<uint64_t, TRACKED_QTYPES + 1> qtypes{};
+    std::array<uint64_t, RCODES> rcodes{};
+    std::array<uint64_t, std::size(DROP_NAMES)> drops{};
+    uint64_t authoritative = 0, forwarded = 0, cache_hits = 0,
+             cache_misses = 0, prefetches = 0, upstream_timeouts = 0,
+             upstream_retries = 0, coalesced = 0, truncated = 0,
+             rate_limited = 0, slipped = 0;
+    std::vector<uint64_t> latency, upstream_rtt;
+
+    for (const auto& worker : this->workers) {
+        for (size_t i = 0; i < qtypes.size(); i++) {
+            qtypes[i] += worker->qtypes[i].load();
+        }
+        for (size_t i = 0; i < rcodes.size(); i++) {
+            rcodes[i] += worker->rcodes[i].load();
+        }
+        for (size_t i = 0; i < drops.size(); i++) {
+            drops[i] += worker->drops[i].load();
+        }
+        authoritative += worker->authoritative.load();
+        forwarded += worker->forwarded.load();
+        cache_hits += worker->cache_hits.load();
+        cache_misses += worker->cache_misses.load();
+        prefetches += worker->prefetches.load();
+        upstream_timeouts += worker->upstream_timeouts.load();
+        upstream_retries += worker->upstream_retries.load();
+        coalesced += worker->coalesced.load();
+        truncated += worker->truncated.load();
+        rate_limited += worker->rate_limited.load();
+        slipped += worker->slipped.load();
+        worker->latency.merge_into(latency);
+        worker->upstream_rtt.merge_into(upstream_rtt);
+    }
+
+    std::string text;
+    auto out = std::back_inserter(text);
+    for (size_t i = 0; i < qtypes.size(); i++) {
+        if (qtypes[i] > 0) {
+            fmt::format_to(out, "queries.{} {}\n", qtype_name(i), qtypes[i]);
+        }
+    }
+    for (size_t i = 0; i < rcodes.size(); i++) {
+        if (rcodes[i] > 0) {
+            fmt::format_to(out, "rcode.{} {}\n", RCODE_NAMES[i], rcodes[i]);
+        }
+    }
+    fmt::format_to(out, "answers.authoritative {}\n", authoritative);
+    fmt::format_to(out, "answers.forwarded {}\n", forwarded);
+    fmt::format_to(out, "answers.truncated {}\n", truncated);
+    fmt::format_to(out, "ratelimit.dropped {}\n", rate_limited);
+    fmt::format_to(out, "ratelimit.slipped {}\n", slipped);
+    fmt::format_to(out, "cache.hits {}\n", cache_hits);
+    fmt::format_to(out, "cache.misses {}\n", cache_misses);
+    fmt::format_to(out, "cache.prefetches {}\n", prefetches);
+    fmt::format_to(out, "upstream.timeouts {}\n", upstream_timeouts);
+    fmt::format_to(out, "upstream.retries {}\n", upstream_retries);
+    fmt::format_to(out, "upstream.coalesced {}\n", coalesced);
+    for (size_t i = 0; i < drops.size(); i++) {
+        fmt::format_to(out, "drops.{} {}\n", DROP_NAMES[i], drops[i]);
+    }
+    fmt::format_to(out, "latency_us {}\n", Histogram::summarize(latency));
+    fmt::format_to(out, "upstream_rtt_us {}\n",
+                   Histogram::summarize(upstream_rtt));
+    return text;
+}
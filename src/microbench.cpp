@@ -0,0 +1,234 @@
+#include <benchmark/benchmark.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <map>
+#include <new>
+
+#include "answer.hpp"
+#include "builder.hpp"
+#include "collection.hpp"
+#include "packet.hpp"
+#include "spdlog/spdlog.h"
+#include "strategy.hpp"
+#include "util.hpp"
+
+// Every allocation in the process is counted, so each benchmark can report
+// how many its operation makes.
+static std::atomic<uint64_t> n_allocs{0};
+
+auto operator new(size_t size) -> void* {
+    n_allocs.fetch_add(1, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+auto operator delete(void* ptr) noexcept -> void { std::free(ptr); }
+auto operator delete(void* ptr, size_t) noexcept -> void { std::free(ptr); }
+
+constexpr size_t HOSTS_PER_ZONE = 16;
+
+template <typename Fn>
+static auto measure(benchmark::State& state, Fn&& fn) -> void {
+    uint64_t before = n_allocs.load(std::memory_order_relaxed);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(fn());
+    }
+    state.counters["allocs/op"] = benchmark::Counter(
+        n_allocs.load(std::memory_order_relaxed) - before,
+        benchmark::Counter::kAvgIterations);
+}
+
+static auto zone_name(size_t zone) -> std::string {
+    return "z" + std::to_string(zone) + ".bench.";
+}
+
+// `n_hosts` hosts, HOSTS_PER_ZONE to a zone, each with A, AAAA, TXT and a
+// CNAME pointing at it, under zones that carry SOA, NS and MX.
+static auto synthetic_zones(size_t n_hosts) -> const Collection& {
+    static std::map<size_t, Collection> built;
+    auto found = built.find(n_hosts);
+    if (found != built.end()) {
+        return found->second;
+    }
+
+    Collection& collection = built[n_hosts];
+    auto add = [&](const std::string& zone, const std::string& name,
+                   const std::string& type, const std::string& rdata) {
+        auto record = RecordBuilder()
+                          .set_name(name)
+                          .set_ttl("300")
+                          .set_class("IN")
+                          .set_type(type)
+                          .set_rdata(split(rdata))
+                          .build();
+        collection.add_record(zone, *record);
+    };
+
+    size_t n_zones = (n_hosts + HOSTS_PER_ZONE - 1) / HOSTS_PER_ZONE;
+    for (size_t z = 0; z < n_zones; z++) {
+        std::string zone = zone_name(z);
+        add(zone, "@", "SOA",
+            "ns." + zone + " admin." + zone + " 1 3600 300 3600000 3600");
+        add(zone, "@", "NS", "ns." + zone);
+        add(zone, "@", "MX", "10 mail." + zone);
+        add(zone, "ns", "A", "10.0.0.1");
+        add(zone, "mail", "A", "10.0.0.2");
+
+        for (size_t h = 0; h < HOSTS_PER_ZONE; h++) {
+            std::string host = "h" + std::to_string(h);
+            add(zone, host, "A", "10.1.0." + std::to_string(h));
+            add(zone, host, "AAAA", "2001:db8::" + std::to_string(h));
+            add(zone, host, "TXT", "v=bench" + std::to_string(h));
+            add(zone, "c" + std::to_string(h), "CNAME", host + "." + zone);
+        }
+    }
+    return collection;
+}
+
+// A query for `name`, or "@" for the apex, in the middle zone of a
+// collection of `n_hosts`.
+static auto query_packet(size_t n_hosts, const std::string& name,
+                         uint16_t qtype) -> Packet {
+    size_t n_zones = (n_hosts + HOSTS_PER_ZONE - 1) / HOSTS_PER_ZONE;
+    std::string zone = zone_name(n_zones / 2);
+    std::string qname = name == "@" ? zone : name + "." + zone;
+
+    Header header{};
+    header.dns_id = 1;
+    header.dns_rd = 1;
+    header.dns_qdcount = 1;
+    header = Header::to_response(header);
+
+    std::vector<uint8_t> wire(sizeof(header));
+    std::copy_n(reinterpret_cast<uint8_t*>(&header), sizeof(header),
+                wire.begin());
+    auto labels = compress_domain(qname);
+    wire.insert(wire.end(), labels.begin(), labels.end());
+    uint16_t tail[] = {htons(qtype), htons(Record::IN)};
+    auto bytes = reinterpret_cast<uint8_t*>(tail);
+    wire.insert(wire.end(), bytes, bytes + sizeof(tail));
+
+    return Packet::from_binary(wire.data(), wire.size());
+}
+
+static auto qname_of(const Packet& packet) -> std::string {
+    return Query::from_binary(packet.payload, packet.plen).qname;
+}
+
+static void BM_QueryFromBinary(benchmark::State& state) {
+    auto packet = query_packet(state.range(0), "h1", Record::A);
+    measure(state,
+            [&] { return Query::from_binary(packet.payload, packet.plen); });
+}
+
+static void BM_PacketViewParse(benchmark::State& state) {
+    auto packet = query_packet(state.range(0), "h1", Record::A);
+    auto raw = packet.raw();
+    size_t len = packet.raw_size();
+    measure(state, [&] { return PacketView::parse(raw.get(), len); });
+}
+
+static void BM_CompressDomain(benchmark::State& state) {
+    std::string qname = "h1." + zone_name(state.range(0));
+    measure(state, [&] { return compress_domain(qname); });
+}
+
+static void BM_SearchDomain(benchmark::State& state) {
+    const auto& collection = synthetic_zones(state.range(0));
+    auto qname = qname_of(query_packet(state.range(0), "h1", Record::A));
+    measure(state, [&] { return collection.search_domain(qname); });
+}
+
+static void BM_SearchRecords(benchmark::State& state) {
+    const auto& collection = synthetic_zones(state.range(0));
+    auto qname = qname_of(query_packet(state.range(0), "h1", Record::A));
+    measure(state, [&] {
+        return collection.search_records(qname, Record::A, Record::IN);
+    });
+}
+
+// Responders are called through the base class, as the server calls them.
+static void BM_Response(benchmark::State& state,
+                        std::shared_ptr<QueryResponder> responder,
+                        const char* name, uint16_t qtype) {
+    const auto& collection = synthetic_zones(state.range(0));
+    auto packet = query_packet(state.range(0), name, qtype);
+    measure(state, [&] { return responder->response(collection, packet); });
+}
+
+// The path the server actually serves: a pre-rendered answer copied out
+// under the query's header.
+static void BM_AnswerWrite(benchmark::State& state) {
+    const auto& collection = synthetic_zones(state.range(0));
+    static std::map<size_t, AnswerTable> tables;
+    auto& table = tables[state.range(0)];
+    if (table.entries().empty()) {
+        std::map<Record::Type, std::shared_ptr<QueryResponder>> handlers = {
+            {Record::A, std::make_shared<ARecordResponder>()},
+            {Record::NS, std::make_shared<NSRecordResponder>()},
+            {Record::MX, std::make_shared<MXRecordResponder>()},
+            {Record::SOA, std::make_shared<SOARecordResponder>()},
+            {Record::TXT, std::make_shared<TXTRecordResponder>()},
+            {Record::AAAA, std::make_shared<AAAARecordResponder>()},
+            {Record::CNAME, std::make_shared<CNAMERecordResponder>()},
+        };
+        table.render(collection, handlers);
+    }
+
+    auto packet = query_packet(state.range(0), "h1", Record::A);
+    auto raw = packet.raw();
+    auto query = *PacketView::parse(raw.get(), packet.raw_size());
+    uint8_t out[PACKET_SIZE];
+    measure(state, [&] {
+        auto answer = table.find(query.qname(), query.qtype);
+        return answer->write(query, out, sizeof(out));
+    });
+}
+
+#define ZONE_SIZES RangeMultiplier(16)->Range(16, 1 << 16)
+
+BENCHMARK(BM_QueryFromBinary)->Arg(16);
+BENCHMARK(BM_PacketViewParse)->Arg(16);
+BENCHMARK(BM_CompressDomain)->Arg(16);
+BENCHMARK(BM_SearchDomain)->ZONE_SIZES;
+BENCHMARK(BM_SearchRecords)->ZONE_SIZES;
+BENCHMARK_CAPTURE(BM_Response, A, std::make_shared<ARecordResponder>(), "h1",
+                  Record::A)
+    ->ZONE_SIZES;
+BENCHMARK_CAPTURE(BM_Response, AAAA, std::make_shared<AAAARecordResponder>(),
+                  "h1", Record::AAAA)
+    ->ZONE_SIZES;
+BENCHMARK_CAPTURE(BM_Response, TXT, std::make_shared<TXTRecordResponder>(),
+                  "h1", Record::TXT)
+    ->ZONE_SIZES;
+BENCHMARK_CAPTURE(BM_Response, CNAME, std::make_shared<CNAMERecordResponder>(),
+                  "c1", Record::CNAME)
+    ->ZONE_SIZES;
+BENCHMARK_CAPTURE(BM_Response, NS, std::make_shared<NSRecordResponder>(), "@",
+                  Record::NS)
+    ->ZONE_SIZES;
+BENCHMARK_CAPTURE(BM_Response, MX, std::make_shared<MXRecordResponder>(), "@",
+                  Record::MX)
+    ->ZONE_SIZES;
+BENCHMARK_CAPTURE(BM_Response, SOA, std::make_shared<SOARecordResponder>(), "@",
+                  Record::SOA)
+    ->ZONE_SIZES;
+BENCHMARK_CAPTURE(BM_Response, NotFound, std::make_shared<NotFoundResponder>(),
+                  "missing", Record::A)
+    ->ZONE_SIZES;
+BENCHMARK(BM_AnswerWrite)->ZONE_SIZES;
+
+int main(int argc, char* argv[]) {
+    spdlog::set_level(spdlog::level::warn);
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return EXIT_FAILURE;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -1,10 +1,14 @@
 #include "packet.hpp"
 
+#include <arpa/inet.h>
+
+#include <algorithm>
+
 #include "spdlog/spdlog.h"
 #include "util.hpp"
 
-auto Header::from_network(void* data) -> Header {
-    Header header = *reinterpret_cast<Header*>(data);
+auto Header::from_network(const void* data) -> Header {
+    Header header = *reinterpret_cast<const Header*>(data);
     header.dns_id = ntohs(header.dns_id);
     header.dns_qdcount = ntohs(header.dns_qdcount);
     header.dns_ancount = ntohs(header.dns_ancount);
@@ -93,15 +97,172 @@ auto Packet::raw_size() const -> size_t {
     return sizeof(this->header) + this->plen;
 }
 
-auto Packet::from_binary(void* data, size_t dlen) -> Packet {
+auto Packet::from_binary(const void* data, size_t dlen) -> Packet {
     Packet packet{};
     packet.header = Header::from_network(data);
 
     packet.plen = dlen - sizeof(packet.header);
 
     packet.payload = std::make_unique<uint8_t[]>(packet.plen);
-    std::copy_n(reinterpret_cast<uint8_t*>(data) + sizeof(packet.header),
+    std::copy_n(reinterpret_cast<const uint8_t*>(data) + sizeof(packet.header),
                 packet.plen, packet.payload.get());
 
     return packet;
 }
+
+auto PacketView::parse(const uint8_t* data, size_t len)
+    -> std::optional<PacketView> {
+    if (len < sizeof(Header)) {
+        return {};
+    }
+
+    PacketView view;
+    view.header = Header::from_network(data);
+    view.data = data;
+    view.len = len;
+    view.name_len = 0;
+
+    if (view.header.dns_qdcount == 0) {
+        return {};
+    }
+
+    size_t cursor = sizeof(Header);
+    while (true) {
+        if (cursor >= len) {
+            return {};
+        }
+
+        uint8_t label_len = data[cursor++];
+        if (label_len == 0) {
+            break;
+        }
+
+        // Questions are never compressed, and names cap at 255 bytes.
+        if ((label_len & 0xc0) != 0 || cursor + label_len > len ||
+            view.name_len + label_len + 1 > MAX_NAME_SIZE) {
+            return {};
+        }
+
+        std::copy_n(data + cursor, label_len, view.name + view.name_len);
+        view.name_len += label_len;
+        view.name[view.name_len++] = '.';
+        cursor += label_len;
+    }
+
+    if (cursor + 2 * sizeof(uint16_t) > len) {
+        return {};
+    }
+
+    uint16_t qtype, qclass;
+    std::copy_n(data + cursor, sizeof(qtype),
+                reinterpret_cast<uint8_t*>(&qtype));
+    std::copy_n(data + cursor + sizeof(qtype), sizeof(qclass),
+                reinterpret_cast<uint8_t*>(&qclass));
+
+    view.qtype = ntohs(qtype);
+    view.qclass = ntohs(qclass);
+    view.question_end = cursor + sizeof(qtype) + sizeof(qclass);
+
+    view.edns = false;
+    view.edns_version = 0;
+    view.edns_size = 0;
+
+    // Queries carry nothing but their OPT record past the question, so
+    // anything else (an UPDATE, say) is not searched for one.
+    const Header& header = view.header;
+    if (header.dns_ancount != 0 || header.dns_nscount != 0 ||
+        header.dns_arcount == 0) {
+        return view;
+    }
+
+    cursor = view.question_end;
+    for (size_t i = 0; i < header.dns_arcount; i++) {
+        // Only OPT has the root name; TSIG and the like are skipped.
+        size_t owner = cursor;
+        while (cursor < len && data[cursor] != 0 &&
+               (data[cursor] & 0xc0) != 0xc0) {
+            cursor += data[cursor] + 1;
+        }
+        if (cursor >= len) {
+            return {};
+        }
+        bool root = cursor == owner && data[cursor] == 0;
+        cursor += data[cursor] == 0 ? 1 : 2;
+
+        if (cursor + 10 > len) {
+            return {};
+        }
+
+        uint16_t type = data[cursor] << 8 | data[cursor + 1];
+        uint16_t rdlength = data[cursor + 8] << 8 | data[cursor + 9];
+        if (root && type == OPT_TYPE) {
+            view.edns = true;
+            view.edns_size = data[cursor + 2] << 8 | data[cursor + 3];
+            view.edns_version = data[cursor + 5];
+        }
+        cursor += 10 + rdlength;
+    }
+
+    if (cursor > len) {
+        return {};
+    }
+
+    return view;
+}
+
+auto PacketView::payload_limit(size_t server_size) const -> size_t {
+    if (!this->edns) {
+        return MIN_UDP_SIZE;
+    }
+    return std::clamp<size_t>(this->edns_size, MIN_UDP_SIZE, server_size);
+}
+
+auto write_question_only(const PacketView& query, bool truncated,
+                         uint8_t* out, size_t size, uint8_t rcode)
+    -> size_t {
+    if (query.question_end > size) {
+        return 0;
+    }
+
+    Header header = query.header;
+    header.dns_qr = 1;
+    header.dns_tc = truncated;
+    header.dns_rcode = rcode;
+    header.dns_qdcount = 1;
+    header.dns_ancount = 0;
+    header.dns_nscount = 0;
+    header.dns_arcount = 0;
+    header = Header::to_response(header);
+
+    std::copy_n(reinterpret_cast<uint8_t*>(&header), sizeof(header), out);
+    std::copy(query.data + sizeof(header), query.data + query.question_end,
+              out + sizeof(header));
+    return query.question_end;
+}
+
+auto append_opt(uint8_t* out, size_t len, size_t size, uint16_t udp_size,
+                uint8_t ext_rcode) -> size_t {
+    if (len < sizeof(Header) || len + OPT_SIZE > size) {
+        return 0;
+    }
+
+    // Root owner, type, class = payload size, TTL = extended rcode, version
+    // 0 and no flags, then an empty rdata.
+    uint8_t opt[OPT_SIZE] = {
+        0,
+        OPT_TYPE >> 8,
+        OPT_TYPE & 0xff,
+        static_cast<uint8_t>(udp_size >> 8),
+        static_cast<uint8_t>(udp_size & 0xff),
+        ext_rcode,
+    };
+    std::copy_n(opt, OPT_SIZE, out + len);
+
+    auto header = reinterpret_cast<Header*>(out);
+    header->dns_arcount = htons(ntohs(header->dns_arcount) + 1);
+    return len + OPT_SIZE;
+}
+
+auto PacketView::qname() const -> std::string_view {
+    return std::string_view(this->name, this->name_len);
+}
@@ -0,0 +1,78 @@
+#include "ratelimit.hpp"
+
+#include <algorithm>
+
+// Slot layout, from the top: a 16-bit key tag, 16 bits of tokens and the
+// millisecond of the last refill in the low 32 bits, which may wrap.
+constexpr unsigned TAG_SHIFT = 48;
+constexpr unsigned TOKEN_SHIFT = 32;
+constexpr uint64_t TOKEN_MASK = 0xffff;
+constexpr uint64_t TIME_MASK = 0xffffffff;
+constexpr uint32_t MAX_RATE = TOKEN_MASK;
+
+// The murmur3 finalizer: every key bit reaches the index and the tag.
+static auto mix(uint64_t key) -> uint64_t {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+RateLimiter::RateLimiter(size_t rate, size_t slip, size_t buckets)
+    : slip(slip),
+      rate(std::clamp<size_t>(rate, 1, MAX_RATE)),
+      burst(this->rate) {
+    size_t size = 1;
+    while (size < buckets) {
+        size <<= 1;
+    }
+    this->mask = size - 1;
+    this->table = std::make_unique<std::atomic<uint64_t>[]>(size);
+}
+
+auto RateLimiter::allow(in_addr_t addr, ResponseClass response,
+                        Clock::time_point now) -> bool {
+    uint64_t prefix = ntohl(addr) & RRL_PREFIX_MASK;
+    uint64_t hash = mix(prefix | static_cast<uint64_t>(response) << 32);
+    uint64_t tag = (hash >> TAG_SHIFT) | 1;  // 0 marks an unused slot
+    uint32_t ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                      now.time_since_epoch())
+                      .count();
+
+    std::atomic<uint64_t>& slot = this->table[hash & this->mask];
+    uint64_t old = slot.load(std::memory_order_relaxed);
+    while (true) {
+        uint64_t tokens = this->burst;
+        uint32_t refilled = ms;
+
+        if ((old >> TAG_SHIFT) == tag) {
+            tokens = (old >> TOKEN_SHIFT) & TOKEN_MASK;
+            refilled = old & TIME_MASK;
+
+            // Only whole tokens are added, and the refill time moves on by
+            // just the time they took, so frequent checks lose nothing.
+            uint64_t added = uint64_t{uint32_t(ms - refilled)} * this->rate /
+                             1000;
+            if (added > 0) {
+                tokens = std::min<uint64_t>(tokens + added, this->burst);
+                refilled = tokens == this->burst
+                               ? ms
+                               : refilled + added * 1000 / this->rate;
+            } else if (tokens == 0) {
+                return false;
+            }
+        }
+
+        if (tokens == 0) {
+            return false;
+        }
+        uint64_t next = tag << TAG_SHIFT | (tokens - 1) << TOKEN_SHIFT |
+                        refilled;
+        if (slot.compare_exchange_weak(old, next,
+                                       std::memory_order_relaxed)) {
+            return true;
+        }
+    }
+}
@@ -0,0 +1,572 @@
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <unordered_map>
+
+#include "loader.hpp"
+#include "metrics.hpp"
+#include "packet.hpp"
+#include "server.hpp"
+#include "spdlog/spdlog.h"
+#include "util.hpp"
+
+constexpr auto QUERY_TIMEOUT = std::chrono::seconds(1);
+constexpr auto SWEEP_INTERVAL = std::chrono::milliseconds(100);
+constexpr size_t MAX_OUTSTANDING = UINT16_MAX;
+constexpr size_t MAX_REPORTED = 10;
+constexpr uint16_t DNS_PORT = 53;
+
+constexpr uint32_t PCAP_MAGIC_USEC = 0xa1b2c3d4;
+constexpr uint32_t PCAP_MAGIC_NSEC = 0xa1b23c4d;
+constexpr uint32_t PCAPNG_MAGIC = 0x0a0d0d0a;
+
+constexpr uint32_t LINKTYPE_NULL = 0;
+constexpr uint32_t LINKTYPE_ETHERNET = 1;
+constexpr uint32_t LINKTYPE_RAW = 101;
+constexpr uint32_t LINKTYPE_LINUX_SLL = 113;
+constexpr uint32_t LINKTYPE_LINUX_SLL2 = 276;
+
+constexpr uint16_t ETHERTYPE_IPV4 = 0x0800;
+constexpr uint16_t ETHERTYPE_VLAN = 0x8100;
+
+// Which part of the server answers a query, decided the way
+// Server::resolve decides it.
+enum class Path {
+    Authoritative,
+    NotFound,
+    Forwarded,
+};
+constexpr size_t PATHS = 3;
+constexpr const char* PATH_NAMES[PATHS] = {"authoritative", "not_found",
+                                           "forwarded"};
+
+// A query seen in the capture, with the response that followed it there.
+struct Captured {
+    std::chrono::nanoseconds offset;
+    std::vector<uint8_t> query;
+    std::vector<uint8_t> response;
+    Path path;
+};
+
+struct PathStats {
+    uint64_t sent = 0;
+    uint64_t answered = 0;
+    uint64_t lost = 0;
+    uint64_t compared = 0;
+    uint64_t mismatched = 0;
+    Histogram latency;
+};
+
+static auto read_u16(const uint8_t* data) -> uint16_t {
+    return (data[0] << 8) | data[1];
+}
+
+// Reads the DNS messages a classic pcap file carries over IPv4 UDP to or
+// from port 53. Fragmented datagrams and TCP are skipped.
+class PcapReader {
+   public:
+    explicit PcapReader(const fs::path& path) : ifs(path, std::ios::binary) {
+        if (!this->ifs) {
+            err_quit("Fail to open capture file");
+        }
+
+        uint8_t header[24];
+        if (!this->ifs.read(reinterpret_cast<char*>(header), sizeof(header))) {
+            err_quit("Capture file is too short");
+        }
+
+        uint32_t magic;
+        std::memcpy(&magic, header, sizeof(magic));
+        if (magic == PCAPNG_MAGIC) {
+            err_quit("pcapng is not supported; convert with editcap -F pcap");
+        }
+        this->swapped = magic == __builtin_bswap32(PCAP_MAGIC_USEC) ||
+                        magic == __builtin_bswap32(PCAP_MAGIC_NSEC);
+        magic = this->u32(header);
+        if (magic != PCAP_MAGIC_USEC && magic != PCAP_MAGIC_NSEC) {
+            err_quit("Not a pcap file");
+        }
+        this->nanoseconds = magic == PCAP_MAGIC_NSEC;
+        this->linktype = this->u32(header + 20) & 0xffff;
+    }
+
+    struct Datagram {
+        std::chrono::nanoseconds time;
+        uint32_t src;
+        uint32_t dst;
+        uint16_t sport;
+        uint16_t dport;
+        const uint8_t* data;
+        size_t len;
+    };
+
+    auto next() -> std::optional<Datagram> {
+        uint8_t header[16];
+        auto raw = reinterpret_cast<char*>(header);
+        while (this->ifs.read(raw, sizeof(header))) {
+            uint32_t captured = this->u32(header + 8);
+            this->frame.resize(captured);
+            if (!this->ifs.read(reinterpret_cast<char*>(this->frame.data()),
+                                captured)) {
+                break;
+            }
+
+            auto datagram = this->decode(this->frame.data(), captured);
+            if (datagram) {
+                uint64_t frac = this->u32(header + 4);
+                datagram->time = std::chrono::seconds(this->u32(header)) +
+                                 std::chrono::nanoseconds(
+                                     this->nanoseconds ? frac : frac * 1000);
+                return datagram;
+            }
+        }
+        return {};
+    }
+
+   private:
+    std::ifstream ifs;
+    bool swapped;
+    bool nanoseconds;
+    uint32_t linktype;
+    std::vector<uint8_t> frame;
+
+    auto u32(const uint8_t* data) const -> uint32_t {
+        uint32_t value;
+        std::memcpy(&value, data, sizeof(value));
+        return this->swapped ? __builtin_bswap32(value) : value;
+    }
+
+    // Strips the link layer, then the IPv4 and UDP headers.
+    auto decode(const uint8_t* data, size_t len) const
+        -> std::optional<Datagram> {
+        size_t offset;
+        uint16_t ethertype = ETHERTYPE_IPV4;
+        switch (this->linktype) {
+            case LINKTYPE_NULL:
+                offset = 4;
+                break;
+            case LINKTYPE_ETHERNET:
+                offset = 14;
+                if (len >= offset) {
+                    ethertype = read_u16(data + 12);
+                }
+                if (ethertype == ETHERTYPE_VLAN && len >= offset + 4) {
+                    ethertype = read_u16(data + 16);
+                    offset += 4;
+                }
+                break;
+            case LINKTYPE_RAW:
+                offset = 0;
+                break;
+            case LINKTYPE_LINUX_SLL:
+                offset = 16;
+                if (len >= offset) {
+                    ethertype = read_u16(data + 14);
+                }
+                break;
+            case LINKTYPE_LINUX_SLL2:
+                offset = 20;
+                if (len >= offset) {
+                    ethertype = read_u16(data);
+                }
+                break;
+            default:
+                return {};
+        }
+        if (ethertype != ETHERTYPE_IPV4 || len < offset + 20) {
+            return {};
+        }
+
+        const uint8_t* ip = data + offset;
+        size_t ihl = (ip[0] & 0x0f) * 4;
+        bool fragment = read_u16(ip + 6) & 0x3fff;
+        if ((ip[0] >> 4) != 4 || ip[9] != IPPROTO_UDP || fragment ||
+            len < offset + ihl + 8) {
+            return {};
+        }
+
+        const uint8_t* udp = ip + ihl;
+        size_t udp_len = read_u16(udp + 4);
+        size_t available = len - offset - ihl;
+        if (udp_len < 8 || udp_len > available) {
+            return {};
+        }
+
+        Datagram datagram{};
+        std::memcpy(&datagram.src, ip + 12, sizeof(datagram.src));
+        std::memcpy(&datagram.dst, ip + 16, sizeof(datagram.dst));
+        datagram.sport = read_u16(udp);
+        datagram.dport = read_u16(udp + 2);
+        datagram.data = udp + 8;
+        datagram.len = udp_len - 8;
+        return datagram;
+    }
+};
+
+static auto classify(const Snapshot& snapshot, const PacketView& query)
+    -> Path {
+    auto qname = query.qname();
+    if (!snapshot.answers->find_zone(qname)) {
+        return Path::Forwarded;
+    }
+    if (query.qclass == Record::IN &&
+        !snapshot.answers->find(qname, query.qtype)) {
+        return Path::NotFound;
+    }
+    return Path::Authoritative;
+}
+
+// Pairs every query to port 53 with the first response to the same client
+// port and ID, and keeps the pairs in capture order.
+static auto read_capture(const fs::path& path, const Snapshot& snapshot)
+    -> std::vector<Captured> {
+    PcapReader reader(path);
+    std::vector<Captured> captured;
+    std::unordered_map<uint64_t, size_t> pending;
+    std::optional<std::chrono::nanoseconds> first;
+    size_t n_unanswered = 0;
+
+    auto key = [](uint32_t addr, uint16_t port, uint16_t id) {
+        return (uint64_t{addr} << 32) | (uint64_t{port} << 16) | id;
+    };
+
+    while (auto datagram = reader.next()) {
+        if (datagram->len < sizeof(Header)) {
+            continue;
+        }
+        Header header = Header::from_network(datagram->data);
+
+        if (datagram->dport == DNS_PORT && !header.dns_qr &&
+            header.dns_opcode == 0) {
+            auto query = PacketView::parse(datagram->data, datagram->len);
+            if (!query) {
+                continue;
+            }
+            first = first.value_or(datagram->time);
+            auto& pair = pending[key(datagram->src, datagram->sport,
+                                     header.dns_id)];
+            pair = captured.size();
+            captured.push_back({
+                .offset = datagram->time - *first,
+                .query = {datagram->data, datagram->data + datagram->len},
+                .response = {},
+                .path = classify(snapshot, *query),
+            });
+        } else if (datagram->sport == DNS_PORT && header.dns_qr) {
+            auto found = pending.find(
+                key(datagram->dst, datagram->dport, header.dns_id));
+            if (found != pending.end()) {
+                captured[found->second].response.assign(
+                    datagram->data, datagram->data + datagram->len);
+                pending.erase(found);
+            }
+        }
+    }
+
+    for (const auto& query : captured) {
+        n_unanswered += query.response.empty();
+    }
+    spdlog::info("Read {} queries, {} without a captured response",
+                 captured.size(), n_unanswered);
+    return captured;
+}
+
+// Skips a possibly compressed name, appending it in lower case to `out`.
+static auto read_name(const uint8_t* data, size_t len, size_t& cursor,
+                      std::string& out) -> bool {
+    size_t at = cursor;
+    bool jumped = false;
+    for (size_t hops = 0; hops < MAX_NAME_SIZE; hops++) {
+        if (at >= len) {
+            return false;
+        }
+        uint8_t label = data[at];
+        if ((label & 0xc0) == 0xc0) {
+            if (at + 1 >= len) {
+                return false;
+            }
+            if (!jumped) {
+                cursor = at + 2;
+            }
+            jumped = true;
+            at = ((label & 0x3f) << 8) | data[at + 1];
+            continue;
+        }
+        if (label == 0) {
+            if (!jumped) {
+                cursor = at + 1;
+            }
+            out += '.';
+            return true;
+        }
+        if (at + 1 + label > len) {
+            return false;
+        }
+        for (size_t i = 0; i < label; i++) {
+            out += static_cast<char>(std::tolower(data[at + 1 + i]));
+        }
+        out += '.';
+        at += 1 + label;
+    }
+    return false;
+}
+
+// The rcode and the answer and authority records of a response, each
+// record as text with the TTL left out, sorted. Names inside the record
+// data are expanded, so two servers compressing differently still agree.
+static auto canonical(const std::vector<uint8_t>& message)
+    -> std::optional<std::vector<std::string>> {
+    const uint8_t* data = message.data();
+    size_t len = message.size();
+    if (len < sizeof(Header)) {
+        return {};
+    }
+    Header header = Header::from_network(data);
+
+    size_t cursor = sizeof(Header);
+    for (size_t i = 0; i < header.dns_qdcount; i++) {
+        std::string skipped;
+        if (!read_name(data, len, cursor, skipped) || cursor + 4 > len) {
+            return {};
+        }
+        cursor += 4;
+    }
+
+    std::vector<std::string> records;
+    records.push_back("rcode " + std::to_string(header.dns_rcode));
+    size_t n_records = header.dns_ancount + header.dns_nscount;
+    for (size_t i = 0; i < n_records; i++) {
+        std::string record = i < header.dns_ancount ? "an " : "ns ";
+        if (!read_name(data, len, cursor, record) || cursor + 10 > len) {
+            return {};
+        }
+        uint16_t type = read_u16(data + cursor);
+        size_t rdlength = read_u16(data + cursor + 8);
+        cursor += 10;
+        if (cursor + rdlength > len) {
+            return {};
+        }
+        record += " " + std::to_string(type) + " " +
+                  std::to_string(read_u16(data + cursor - 8)) + " ";
+
+        size_t rdata = cursor;
+        size_t names = 0, fixed_before = 0;
+        switch (type) {
+            case Record::NS:
+            case Record::CNAME:
+                names = 1;
+                break;
+            case Record::MX:
+                names = 1;
+                fixed_before = 2;
+                break;
+            case Record::SOA:
+                names = 2;
+                break;
+        }
+        for (size_t j = 0; j < fixed_before; j++) {
+            record += fmt::format("{:02x}", data[rdata++]);
+        }
+        for (size_t j = 0; j < names; j++) {
+            record += ' ';
+            if (!read_name(data, len, rdata, record)) {
+                return {};
+            }
+        }
+        record += ' ';
+        for (; rdata < cursor + rdlength; rdata++) {
+            record += fmt::format("{:02x}", data[rdata]);
+        }
+        records.push_back(std::move(record));
+        cursor += rdlength;
+    }
+
+    std::sort(records.begin(), records.end());
+    return records;
+}
+
+int main(int argc, char* argv[]) {
+    spdlog::set_level(spdlog::level::info);
+
+    if (argc < 4) {
+        std::cerr << "usage: " << argv[0]
+                  << " <port> <capture.pcap> <config-path>\n"
+                  << "env: SERVER SPEED OUTSTANDING\n";
+        exit(EXIT_FAILURE);
+    }
+
+    uint16_t port = std::stoul(argv[1]);
+
+    // The server's own zones tell which path each query takes through it.
+    ZoneLoader loader{.path = argv[3]};
+    auto snapshot = loader.load();
+    if (!snapshot) {
+        err_quit("Fail to load config");
+    }
+    snapshot->render({
+        {Record::A, std::make_shared<ARecordResponder>()},
+        {Record::NS, std::make_shared<NSRecordResponder>()},
+        {Record::MX, std::make_shared<MXRecordResponder>()},
+        {Record::SOA, std::make_shared<SOARecordResponder>()},
+        {Record::TXT, std::make_shared<TXTRecordResponder>()},
+        {Record::AAAA, std::make_shared<AAAARecordResponder>()},
+        {Record::CNAME, std::make_shared<CNAMERecordResponder>()},
+    });
+    auto queries = read_capture(argv[2], *snapshot);
+    if (queries.empty()) {
+        spdlog::error("No queries in {}", argv[2]);
+        exit(EXIT_FAILURE);
+    }
+
+    // SPEED scales the captured rate; 0 sends as fast as the window allows.
+    const char* speed_env = getenv("SPEED");
+    double speed = speed_env ? std::stod(speed_env) : 1.0;
+    size_t outstanding =
+        std::clamp<size_t>(env_or("OUTSTANDING", 100), 1, MAX_OUTSTANDING);
+    const char* server = getenv("SERVER");
+
+    sockaddr_in sin{.sin_family = AF_INET, .sin_port = htons(port)};
+    std::string address = server ? server : "127.0.0.1";
+    if (inet_pton(AF_INET, address.c_str(), &sin.sin_addr) <= 0) {
+        err_quit("Can't convert IPv4 address for " + address);
+    }
+
+    int sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP);
+    if (sock < 0 || connect(sock, (sockaddr*)&sin, sizeof(sin)) < 0) {
+        err_quit("Fail to connect to server");
+    }
+    int buffer = 4 << 20;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+
+    // In-flight queries by the ID they were sent with, as in loadgen.
+    std::vector<Clock::time_point> sent_at(MAX_OUTSTANDING + 1);
+    std::vector<uint32_t> in_flight(MAX_OUTSTANDING + 1);
+    std::vector<bool> live(MAX_OUTSTANDING + 1);
+    size_t n_flight = 0;
+    uint16_t next_id = 0;
+    size_t next = 0;
+
+    std::array<PathStats, PATHS> stats;
+    size_t n_reported = 0;
+
+    auto start = Clock::now();
+    auto last_sweep = start;
+    uint8_t buf[PACKET_SIZE];
+
+    while (next < queries.size() || n_flight > 0) {
+        auto now = Clock::now();
+
+        while (next < queries.size() && n_flight < outstanding &&
+               !live[next_id]) {
+            auto& query = queries[next];
+            if (speed > 0 &&
+                now - start < std::chrono::duration_cast<Clock::duration>(
+                                  query.offset / speed)) {
+                break;
+            }
+
+            uint16_t id = htons(next_id);
+            std::copy_n(reinterpret_cast<uint8_t*>(&id), sizeof(id),
+                        query.query.begin());
+            if (send(sock, query.query.data(), query.query.size(), 0) < 0) {
+                break;
+            }
+            sent_at[next_id] = now;
+            in_flight[next_id] = next;
+            live[next_id] = true;
+            stats[static_cast<size_t>(query.path)].sent++;
+            next_id++;
+            n_flight++;
+            next++;
+        }
+
+        bool spin = next < queries.size() && speed == 0 &&
+                    n_flight < outstanding;
+        pollfd fds{.fd = sock, .events = POLLIN};
+        poll(&fds, 1, spin ? 0 : 1);
+
+        int len;
+        while ((len = recv(sock, buf, sizeof(buf), 0)) >= 0) {
+            if (static_cast<size_t>(len) < sizeof(Header)) {
+                continue;
+            }
+            Header header = Header::from_network(buf);
+            if (!live[header.dns_id]) {
+                continue;
+            }
+            live[header.dns_id] = false;
+            n_flight--;
+
+            const auto& query = queries[in_flight[header.dns_id]];
+            auto& path = stats[static_cast<size_t>(query.path)];
+            path.answered++;
+            path.latency.record(Clock::now() - sent_at[header.dns_id]);
+
+            if (query.response.empty()) {
+                continue;
+            }
+            path.compared++;
+            auto expected = canonical(query.response);
+            auto actual = canonical({buf, buf + len});
+            if (expected == actual) {
+                continue;
+            }
+            path.mismatched++;
+            if (n_reported++ < MAX_REPORTED) {
+                auto parsed = PacketView::parse(buf, len);
+                spdlog::warn("{} answer differs for {} type {}",
+                             PATH_NAMES[static_cast<size_t>(query.path)],
+                             parsed ? parsed->qname() : "?",
+                             parsed ? parsed->qtype : 0);
+            }
+        }
+
+        now = Clock::now();
+        if (now - last_sweep >= SWEEP_INTERVAL) {
+            for (size_t id = 0; id <= MAX_OUTSTANDING; id++) {
+                if (live[id] && now - sent_at[id] >= QUERY_TIMEOUT) {
+                    live[id] = false;
+                    n_flight--;
+                    stats[static_cast<size_t>(queries[in_flight[id]].path)]
+                        .lost++;
+                }
+            }
+            last_sweep = now;
+        }
+    }
+
+    using Seconds = std::chrono::duration<double>;
+    double seconds = Seconds(Clock::now() - start).count();
+    double captured = Seconds(queries.back().offset).count();
+    std::cout << fmt::format(
+        "replayed {} queries in {:.2f}s (captured {:.2f}s)\n",
+        queries.size(), seconds, captured);
+
+    uint64_t n_answered = 0, n_mismatched = 0;
+    for (size_t i = 0; i < PATHS; i++) {
+        const auto& path = stats[i];
+        if (path.sent == 0) {
+            continue;
+        }
+        std::vector<uint64_t> totals;
+        path.latency.merge_into(totals);
+        std::cout << fmt::format(
+            "{} sent {} answered {} lost {} qps {:.1f} mismatched {}/{}\n",
+            PATH_NAMES[i], path.sent, path.answered, path.lost,
+            path.answered / seconds, path.mismatched, path.compared);
+        std::cout << PATH_NAMES[i] << " latency_us "
+                  << Histogram::summarize(totals) << "\n";
+        n_answered += path.answered;
+        n_mismatched += path.mismatched;
+    }
+    std::cout << fmt::format("qps {:.1f}\n", n_answered / seconds);
+
+    return n_answered > 0 && n_mismatched == 0 ? 0 : EXIT_FAILURE;
+}
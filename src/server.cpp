@@ -2,145 +2,755 @@
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <sstream>
+#include <thread>
 
 #include "builder.hpp"
 #include "spdlog/spdlog.h"
 #include "strategy.hpp"
 #include "util.hpp"
 
+Batch::Batch(size_t size)
+    : bufs(size),
+      senders(size),
+      recv_iovs(size),
+      recv_msgs(size),
+      replies(size),
+      send_iovs(size),
+      send_msgs(size) {
+    for (size_t i = 0; i < size; i++) {
+        this->recv_iovs[i] = {.iov_base = this->bufs[i].data(),
+                              .iov_len = PACKET_SIZE};
+    }
+}
+
 auto Server::run() -> void {
+    // Only the reload thread takes SIGHUP; every thread inherits this mask.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    std::vector<std::thread> threads;
+    threads.emplace_back([this] { this->wait_reload(); });
+    threads.emplace_back([this] { this->updater->run(); });
+    if (this->stats) {
+        threads.emplace_back([this] { this->stats->run(); });
+    }
+    for (size_t i = 1; i < this->workers.size(); i++) {
+        threads.emplace_back([this, i] { this->serve(this->workers[i]); });
+    }
+
+    this->serve(this->workers[0]);
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+auto Server::wait_reload() -> void {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+
     while (true) {
-        auto data = this->receive(this->client_sock);
+        int sig;
+        if (sigwait(&signals, &sig) == 0) {
+            this->updater->request_reload();
+        }
+    }
+}
 
-        if (!data) {
-            spdlog::warn("Receive packet failed");
-            continue;
+auto Server::serve(Worker& worker) -> void {
+    if (this->backend == Backend::Uring) {
+        auto ring = IoRing::create(RING_ENTRIES);
+        if (ring && ring->provide_buffers(RING_CLIENT, RING_BUFFERS) &&
+            ring->provide_buffers(RING_FORWARD, RING_BUFFERS)) {
+            worker.ring = ring.get();
+            this->serve_ring(worker, *ring);
+            worker.ring = nullptr;
         }
+        spdlog::warn("Worker {} falls back to the recvfrom loop", worker.id);
+    }
+
+    Batch batch(this->batch_size);
+    this->watch(worker, true);
+
+    epoll_event events[MAX_EVENTS];
+    auto last_sweep = Clock::now();
 
-        auto [pkt, sender] = std::move(data.value());
-        auto [qname, qtype, qclass] = Query::from_binary(pkt.payload, pkt.plen);
+    while (true) {
+        this->snapshots->quiesce(worker.id);
+
+        int ret = epoll_wait(worker.epoll_fd, events, MAX_EVENTS,
+                             POLL_TIMEOUT_MS);
 
-        auto domain_name = this->collection.search_domain(qname);
+        if (ret < 0) {
+            if (errno != EINTR) {
+                spdlog::warn("Poll failed: {}", strerror(errno));
+            }
+            continue;
+        }
 
-        if (!domain_name) {
-            // pass to another dns server
-            pkt.header = Header::to_response(pkt.header);
-            auto ret_pkt = this->forward(pkt);
-            if (!data) {
-                spdlog::warn("forward server not response");
+        bool client_ready = false;
+        uint32_t forward_ready = 0;
+        for (int i = 0; i < ret; i++) {
+            uint64_t id = events[i].data.u64;
+            if (id >= EPOLL_FORWARD && id < FIRST_STREAM_ID) {
+                forward_ready |= 1u << (id - EPOLL_FORWARD);
                 continue;
             }
 
-            ret_pkt->header = Header::to_response(ret_pkt->header);
-            auto error = this->send(this->client_sock, ret_pkt->raw(),
-                                    ret_pkt->raw_size(), sender);
+            if (id == EPOLL_UDP) {
+                client_ready = true;
+            } else {
+                this->serve_event(worker, id, events[i].events);
+            }
+        }
 
-            if (error) {
-                spdlog::warn("Fail to send forward packet: {}", error.value());
+        for (size_t i = 0; i < worker.forwarder.upstreams.size(); i++) {
+            if (forward_ready & (1u << i)) {
+                this->relay(worker, i);
             }
+        }
 
-            continue;
+        if (client_ready) {
+            if (this->batch_size > 1) {
+                this->answer_batch(worker, batch);
+            } else {
+                this->answer_one(worker);
+            }
         }
 
-        auto records = this->collection.search_records(qname, qtype, qclass);
+        this->maintain(worker, last_sweep);
+    }
+}
+
+// Receives stay armed on both datagram sockets, and replies queued while
+// completions are handled go out with the next wait, so a busy worker
+// makes one system call per round. TCP stays on the epoll set, which the
+// ring polls as one more file. Returns when a receive fails in a way that
+// re-arming would only repeat, so the worker can carry on without the ring.
+auto Server::serve_ring(Worker& worker, IoRing& ring) -> void {
+    this->watch(worker, false);
+
+    ring.recv_multishot(worker.client_sock, RING_CLIENT, RING_CLIENT);
+    for (size_t i = 0; i < worker.forwarder.upstreams.size(); i++) {
+        ring.recv_multishot(worker.forwarder.upstreams[i].sock, RING_FORWARD,
+                            RING_FORWARD | i << RING_UPSTREAM_SHIFT);
+    }
+    ring.poll_multishot(worker.epoll_fd, RING_STREAMS);
+
+    uint8_t reply[PACKET_SIZE];
+    epoll_event events[MAX_EVENTS];
+    auto last_sweep = Clock::now();
+    bool broken = false;
+
+    auto on_completion = [&](const RingCompletion& done) {
+        if (done.tag == RING_STREAMS) {
+            int ret = epoll_wait(worker.epoll_fd, events, MAX_EVENTS, 0);
+            for (int i = 0; i < ret; i++) {
+                this->serve_event(worker, events[i].data.u64,
+                                  events[i].events);
+            }
+            if (!done.more()) {
+                ring.poll_multishot(worker.epoll_fd, RING_STREAMS);
+            }
+            return;
+        }
 
-        if (records.empty()) {
-            auto ret_pkt = NotFoundResponder().response(this->collection, pkt);
+        auto group = static_cast<uint16_t>(done.tag);
+        size_t upstream = done.tag >> RING_UPSTREAM_SHIFT;
+        auto message = ring.message(group, done);
 
-            if (!ret_pkt) {
-                spdlog::warn("Fail to build not found packet");
-                continue;
+        if (message && group == RING_CLIENT) {
+            auto query = PacketView::parse(message->data, message->len);
+            Client client{message->from, 0, Clock::now()};
+
+            size_t len = 0;
+            if (query) {
+                len = this->handle(worker, *query, client, reply,
+                                   sizeof(reply));
+            } else {
+                worker.metrics->drop(Drop::Malformed);
+            }
+            if (len > 0) {
+                auto error = this->reply(worker, client, reply, len);
+                if (error) {
+                    spdlog::warn("Fail to send response packet: {}",
+                                 error.value());
+                }
+            }
+        } else if (message) {
+            auto waiters = worker.forwarder.match(upstream, message->data,
+                                                  message->len);
+            if (waiters) {
+                this->deliver(worker, *waiters, message->data, message->len);
             }
+        }
 
-            auto error = this->send(this->client_sock, ret_pkt->raw(),
-                                    ret_pkt->raw_size(), sender);
+        if (done.has_buffer()) {
+            ring.recycle(group, done.buffer_id());
+        }
 
-            if (error) {
-                spdlog::warn("Fail to send not found packet: {}",
-                             error.value());
+        // Running out of buffers ends a multishot receive; they are all
+        // back by now. Any other error, such as -EINVAL from a kernel
+        // without multishot recvmsg, would fail again once re-armed.
+        if (!done.more() && !broken) {
+            if (done.res == -ECONNREFUSED && group == RING_FORWARD) {
+                worker.forwarder.refused(upstream);
+            } else if (done.res < 0 && done.res != -ENOBUFS) {
+                spdlog::warn("Ring receive failed: {}", strerror(-done.res));
+                broken = true;
+                return;
             }
+            int sock = group == RING_CLIENT
+                           ? worker.client_sock
+                           : worker.forwarder.upstreams[upstream].sock;
+            ring.recv_multishot(sock, group, done.tag);
+        }
+    };
+
+    while (!broken) {
+        this->snapshots->quiesce(worker.id);
+
+        ring.wait(std::chrono::milliseconds(POLL_TIMEOUT_MS));
+        ring.for_each_completion(on_completion);
+
+        this->maintain(worker, last_sweep);
+    }
+}
+
+// A worker falling back from the ring already has a set holding its TCP
+// listener and connections, and only adds the datagram sockets to it.
+auto Server::watch(Worker& worker, bool datagrams) -> void {
+    bool fresh = worker.epoll_fd < 0;
+    if (fresh) {
+        worker.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    }
+    if (worker.epoll_fd < 0) {
+        err_quit("Fail to create epoll instance");
+    }
+    worker.forwarder.epoll_fd = worker.epoll_fd;
+
+    std::vector<std::pair<int, uint64_t>> sockets = {
+        {datagrams ? worker.client_sock : -1, EPOLL_UDP},
+        {fresh ? worker.streams.listen_sock : -1, EPOLL_LISTEN},
+        {fresh ? worker.update_replies->event : -1, EPOLL_UPDATES},
+    };
+    for (size_t i = 0; i < worker.forwarder.upstreams.size(); i++) {
+        int sock = worker.forwarder.upstreams[i].sock;
+        sockets.emplace_back(datagrams ? sock : -1, EPOLL_FORWARD + i);
+    }
+    for (auto [fd, id] : sockets) {
+        epoll_event event{.events = EPOLLIN, .data = {.u64 = id}};
+        if (fd >= 0 &&
+            epoll_ctl(worker.epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            err_quit("Fail to watch socket");
+        }
+    }
+}
+
+auto Server::maintain(Worker& worker, Clock::time_point& last_sweep)
+    -> void {
+    auto now = Clock::now();
+    if (now - last_sweep >= TCP_SWEEP_INTERVAL) {
+        worker.streams.sweep(worker.epoll_fd, now);
+        last_sweep = now;
+    }
+
+    if (!worker.forwarder.has_pending()) {
+        return;
+    }
+
+    for (auto& [ret_pkt, waiter] : worker.forwarder.expire(now)) {
+        worker.metrics->rcodes[SERVFAIL].add();
+
+        // A client that sent EDNS gets an OPT back, as from answer().
+        uint8_t pkt[PACKET_SIZE];
+        size_t nbytes = std::min<size_t>(ret_pkt.raw_size(), sizeof(pkt));
+        std::copy_n(ret_pkt.raw().get(), nbytes, pkt);
+        if (waiter.edns) {
+            if (size_t len =
+                    append_opt(pkt, nbytes, sizeof(pkt), this->edns_size)) {
+                nbytes = len;
+            }
+        }
+
+        auto error = this->reply(worker, waiter.client, pkt, nbytes);
+
+        if (error) {
+            spdlog::warn("Fail to send servfail packet: {}", error.value());
+        }
+    }
+}
+
+// Events on the TCP side of a worker, which both backends keep on the
+// epoll set.
+auto Server::serve_event(Worker& worker, uint64_t id, uint32_t events)
+    -> void {
+    if (id == EPOLL_LISTEN) {
+        worker.streams.accept(worker.epoll_fd);
+    } else if (id == EPOLL_UPDATES) {
+        this->answer_updates(worker);
+    } else if (id & EPOLL_UPSTREAM_STREAM) {
+        std::vector<uint8_t> answer;
+        auto waiters = worker.forwarder.stream_ready(id, events, answer);
+        if (waiters) {
+            this->deliver(worker, *waiters, answer.data(), answer.size());
+        }
+    } else {
+        this->serve_stream(worker, id, events);
+    }
+}
+
+auto Server::serve_stream(Worker& worker, uint64_t id, uint32_t events)
+    -> void {
+    auto& streams = worker.streams;
+    Connection* conn = streams.find(id);
+    if (conn == nullptr) {
+        return;
+    }
+
+    bool alive = !(events & EPOLLERR);
+    if (alive && (events & (EPOLLIN | EPOLLRDHUP))) {
+        alive = streams.read(*conn);
+    }
+
+    // Answer every complete message; replies to forwarded queries are
+    // queued later by relay(), so they may overtake or trail these.
+    size_t cursor = 0;
+    uint8_t reply[TCP_MAX_MESSAGE];
+    Client client{conn->peer, id, Clock::now()};
+    while (alive && conn->in.size() - cursor >= sizeof(uint16_t)) {
+        size_t len = conn->in[cursor] << 8 | conn->in[cursor + 1];
+        if (conn->in.size() - cursor - sizeof(uint16_t) < len) {
+            break;
+        }
+        cursor += sizeof(uint16_t);
+
+        auto query = PacketView::parse(conn->in.data() + cursor, len);
+        cursor += len;
+        if (!query) {
+            worker.metrics->drop(Drop::Malformed);
             continue;
         }
 
-        auto responder =
-            this->registered_handler.find(static_cast<Record::Type>(qtype));
+        size_t nbytes =
+            this->handle(worker, *query, client, reply, sizeof(reply));
+        if (nbytes > 0) {
+            alive = streams.queue(*conn, reply, nbytes);
+        }
+    }
+    conn->in.erase(conn->in.begin(), conn->in.begin() + cursor);
 
-        if (responder == this->registered_handler.end()) {
-            spdlog::warn("No responder for type {}", qtype);
+    if (alive) {
+        alive = streams.flush(worker.epoll_fd, id, *conn);
+    }
+
+    if (!alive || (events & EPOLLHUP)) {
+        streams.close(worker.epoll_fd, id);
+    }
+}
+
+// Writes the replies the updater posted for UPDATEs that came over TCP.
+auto Server::answer_updates(Worker& worker) -> void {
+    for (auto& [stream, reply] : worker.update_replies->take()) {
+        Client client{{}, stream, Clock::now()};
+        auto error = this->reply(worker, client, reply.data(), reply.size());
+        if (error) {
+            spdlog::warn("Fail to send update response: {}", error.value());
+        }
+    }
+}
+
+auto Server::answer_one(Worker& worker) -> void {
+    sockaddr_in sender{};
+    socklen_t sinlen = sizeof(sender);
+    uint8_t buf[PACKET_SIZE], reply[PACKET_SIZE];
+
+    int ret = recvfrom(worker.client_sock, buf, sizeof(buf), MSG_DONTWAIT,
+                       reinterpret_cast<sockaddr*>(&sender), &sinlen);
+
+    if (ret < 0) {
+        spdlog::warn("Receive packet failed");
+        return;
+    }
+
+    auto query = PacketView::parse(buf, ret);
+    if (!query) {
+        worker.metrics->drop(Drop::Malformed);
+        return;
+    }
+
+    Client client{sender, 0, Clock::now()};
+    size_t len = this->handle(worker, *query, client, reply, sizeof(reply));
+    if (len == 0) {
+        return;
+    }
+
+    auto error = this->reply(worker, client, reply, len);
+
+    if (error) {
+        spdlog::warn("Fail to send response packet: {}", error.value());
+    }
+}
+
+auto Server::answer_batch(Worker& worker, Batch& batch) -> void {
+    const size_t n = this->batch_size;
+
+    for (size_t i = 0; i < n; i++) {
+        batch.recv_msgs[i] = {};
+        batch.recv_msgs[i].msg_hdr.msg_name = &batch.senders[i];
+        batch.recv_msgs[i].msg_hdr.msg_namelen = sizeof(batch.senders[i]);
+        batch.recv_msgs[i].msg_hdr.msg_iov = &batch.recv_iovs[i];
+        batch.recv_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int nrecv = recvmmsg(worker.client_sock, batch.recv_msgs.data(), n,
+                         MSG_DONTWAIT, nullptr);
+
+    if (nrecv < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            spdlog::warn("Receive batch failed: {}", strerror(errno));
+        }
+        return;
+    }
+
+    size_t nreply = 0;
+    auto received = Clock::now();
+    for (int i = 0; i < nrecv; i++) {
+        auto query = PacketView::parse(batch.bufs[i].data(),
+                                       batch.recv_msgs[i].msg_len);
+        if (!query) {
+            worker.metrics->drop(Drop::Malformed);
+            continue;
+        }
+
+        auto& reply = batch.replies[nreply];
+        Client client{batch.senders[i], 0, received};
+        size_t len = this->handle(worker, *query, client, reply.data(),
+                                  reply.size());
+        if (len == 0) {
             continue;
         }
 
-        auto ret_pkt = responder->second->response(this->collection, pkt);
+        batch.send_iovs[nreply] = {.iov_base = reply.data(), .iov_len = len};
+
+        auto& msg = batch.send_msgs[nreply];
+        msg = {};
+        msg.msg_hdr.msg_name = &batch.senders[i];
+        msg.msg_hdr.msg_namelen = sizeof(batch.senders[i]);
+        msg.msg_hdr.msg_iov = &batch.send_iovs[nreply];
+        msg.msg_hdr.msg_iovlen = 1;
+        nreply++;
+    }
 
-        if (!ret_pkt) {
-            spdlog::warn("Fail to build response packet");
+    // sendmmsg may stop early; resume from the first unsent reply and
+    // drop the one that failed so a bad destination can't stall the batch.
+    size_t sent = 0;
+    while (sent < nreply) {
+        int ret = sendmmsg(worker.client_sock, batch.send_msgs.data() + sent,
+                           nreply - sent, 0);
+        if (ret < 0) {
+            spdlog::warn("Fail to send response packet: {}", strerror(errno));
+            worker.metrics->drop(Drop::SendFailed);
+            sent++;
             continue;
         }
+        sent += ret;
+    }
+
+    batch.stats.batches++;
+    batch.stats.packets += nrecv;
+
+    auto now = Clock::now();
+    if (now - batch.last_report >= STATS_INTERVAL) {
+        spdlog::info("Batch fill {:.2f}/{} over {} batches",
+                     static_cast<double>(batch.stats.packets) /
+                         batch.stats.batches,
+                     n, batch.stats.batches);
+        batch.stats = {};
+        batch.last_report = now;
+    }
+}
+
+auto Server::relay(Worker& worker, size_t upstream) -> void {
+    uint8_t buf[PACKET_SIZE];
+
+    while (auto data = worker.forwarder.receive(upstream, buf, sizeof(buf))) {
+        auto& [len, waiters] = data.value();
+        this->deliver(worker, waiters, buf, len);
+    }
+}
+
+// Hands one upstream answer to every client that waited on it, each under
+// its own ID. A prefetched answer only goes to the cache.
+auto Server::deliver(Worker& worker, const std::vector<Waiter>& waiters,
+                     uint8_t* pkt, size_t nbytes) -> void {
+    if (this->cache) {
+        this->cache->store(pkt, nbytes);
+    }
+
+    auto now = Clock::now();
+    for (const auto& [header, client, edns] : waiters) {
+        uint16_t client_id = htons(header.dns_id);
+        std::copy_n(reinterpret_cast<uint8_t*>(&client_id), sizeof(client_id),
+                    pkt);
+
+        worker.metrics->rcodes[pkt[3] & 0x0f].add();
+        worker.metrics->latency.record(now - client.received);
 
-        auto error = this->send(this->client_sock, ret_pkt->raw(),
-                                ret_pkt->raw_size(), sender);
+        auto error = this->reply(worker, client, pkt, nbytes);
 
         if (error) {
-            spdlog::warn("Fail to send response packet: {}", error.value());
+            spdlog::warn("Fail to send forward packet: {}", error.value());
         }
     }
 }
 
-auto Server::receive(int sock_fd)
-    -> std::optional<std::pair<Packet, sockaddr_in>> {
-    sockaddr_in sin{};
-    socklen_t sinlen = sizeof(sin);
-    uint8_t buf[PACKET_SIZE] = {};
+auto Server::handle(Worker& worker, const PacketView& query,
+                    const Client& client, uint8_t* out, size_t size)
+    -> size_t {
+    worker.metrics->query(query.qtype);
 
-    int ret = recvfrom(sock_fd, buf, sizeof(buf), 0,
-                       reinterpret_cast<sockaddr*>(&sin), &sinlen);
+    size_t len = this->answer(worker, query, client, out, size);
+    if (len > 0) {
+        worker.metrics->rcodes[out[3] & 0x0f].add();
+        worker.metrics->latency.record(Clock::now() - client.received);
+    }
+    return len;
+}
 
-    if (ret < 0) {
-        return {};
+auto Server::answer(Worker& worker, const PacketView& query,
+                    const Client& client, uint8_t* out, size_t size)
+    -> size_t {
+    if (query.header.dns_opcode == OPCODE_UPDATE) {
+        UpdateOrigin origin{client.addr, worker.client_sock, client.stream,
+                            worker.update_replies};
+        return this->updater->submit(query, origin, out, size);
+    }
+
+    // A TCP reply may take the whole buffer; a UDP one only what the
+    // client can take, less room for the OPT record it is owed.
+    if (client.stream == 0) {
+        size = std::min(size, query.payload_limit(this->edns_size));
+    }
+
+    if (!query.edns) {
+        return this->resolve(worker, query, client, out, size);
+    }
+
+    if (query.edns_version > 0) {
+        if (auto limited = this->limit(worker, query, client,
+                                       ResponseClass::Error, out, size)) {
+            return *limited;
+        }
+        size_t len = write_question_only(query, false, out, size);
+        return append_opt(out, len, size, this->edns_size, EDNS_BADVERS);
     }
 
-    return std::pair{Packet::from_binary(buf, ret), sin};
+    size_t len = this->resolve(worker, query, client, out, size - OPT_SIZE);
+    if (len == 0) {
+        return 0;
+    }
+    return append_opt(out, len, size, this->edns_size);
 }
 
-auto Server::forward(const Packet& packet) -> std::optional<Packet> {
-    spdlog::debug("before send");
+auto Server::resolve(Worker& worker, const PacketView& query,
+                     const Client& client, uint8_t* out, size_t size)
+    -> size_t {
+    const Snapshot* snapshot = this->snapshots->current();
+    auto qname = query.qname();
+    auto domain_name = snapshot->answers->find_zone(qname);
+
+    if (!domain_name) {
+        // Checked before the cache too, so a flood costs neither a lookup
+        // nor an upstream round trip.
+        if (auto limited = this->limit(worker, query, client,
+                                       ResponseClass::Forwarded, out, size)) {
+            return *limited;
+        }
+
+        if (this->cache) {
+            bool refresh;
+            size_t len = this->cache->lookup(query, out, size, refresh);
+            if (len > 0) {
+                worker.metrics->cache_hits.add();
+                // A hot name is fetched again before it expires, so its
+                // clients keep being answered from the cache.
+                if (refresh) {
+                    bool sent;
+                    auto error = worker.forwarder.prefetch(query, sent);
+                    if (error) {
+                        spdlog::debug("Fail to prefetch {}: {}", qname,
+                                      error.value());
+                    } else if (sent) {
+                        worker.metrics->prefetches.add();
+                    }
+                }
+                return len;
+            }
+            worker.metrics->cache_misses.add();
+        }
+
+        // pass to another dns server; the answer is relayed when it arrives
+        auto error = worker.forwarder.submit(query, client);
+        if (error) {
+            spdlog::warn("Fail to forward to server: {}", error.value());
+            worker.metrics->drop(Drop::ForwardFailed);
+        } else {
+            worker.metrics->forwarded.add();
+        }
+        return 0;
+    }
 
-    auto error = this->send(this->forward_sock, packet.raw(), packet.raw_size(),
-                            this->forward_sin);
+    worker.metrics->authoritative.add();
 
-    spdlog::debug("after send");
+    if (query.qclass == Record::IN) {
+        auto answer = snapshot->answers->find(qname, query.qtype);
+        auto response =
+            answer ? ResponseClass::Answer : ResponseClass::NotFound;
+        if (!answer) {
+            answer = snapshot->answers->find_missing(*domain_name);
+        }
 
-    if (error) {
-        spdlog::warn("Fail to forward to server: {}", error.value());
-        return {};
+        if (auto limited =
+                this->limit(worker, query, client, response, out, size)) {
+            return *limited;
+        }
+
+        if (!answer) {
+            spdlog::warn("Fail to build not found packet");
+            return 0;
+        }
+
+        if (query.question_end + answer->sections_len > size) {
+            spdlog::debug("Truncate answer for {} to {} bytes", qname, size);
+            worker.metrics->truncated.add();
+            return write_question_only(query, true, out, size);
+        }
+        return answer->write(query, out, size);
+    }
+
+    // A compiled image only holds IN answers, and carries no records to
+    // build the other classes from.
+    if (!snapshot->collection) {
+        if (auto limited = this->limit(worker, query, client,
+                                       ResponseClass::Error, out, size)) {
+            return *limited;
+        }
+        return write_question_only(query, false, out, size, REFUSED);
+    }
+
+    // Other classes are rare enough to build through the responders.
+    auto pkt = Packet::from_binary(query.data, query.len);
+    const Collection& collection = *snapshot->collection;
+    auto records = collection.search_records(
+        std::string(qname), query.qtype, query.qclass);
+
+    auto response =
+        records.empty() ? ResponseClass::NotFound : ResponseClass::Answer;
+    if (auto limited =
+            this->limit(worker, query, client, response, out, size)) {
+        return *limited;
+    }
+
+    std::optional<Packet> ret_pkt;
+    if (records.empty()) {
+        ret_pkt = NotFoundResponder().response(collection, pkt);
+    } else {
+        auto responder = this->registered_handler.find(
+            static_cast<Record::Type>(query.qtype));
+
+        if (responder == this->registered_handler.end()) {
+            spdlog::warn("No responder for type {}", query.qtype);
+            return 0;
+        }
+        ret_pkt = responder->second->response(collection, pkt);
+    }
+
+    if (!ret_pkt) {
+        spdlog::warn("Fail to build response packet for {}", qname);
+        return write_question_only(query, false, out, size, SERVFAIL);
     }
 
-    spdlog::debug("before receive");
-    auto data = this->receive(this->forward_sock);
-    if (!data) {
-        spdlog::warn("forward server not response");
+    if (ret_pkt->raw_size() > size) {
+        worker.metrics->truncated.add();
+        return write_question_only(query, true, out, size);
+    }
+
+    std::copy_n(ret_pkt->raw().get(), ret_pkt->raw_size(), out);
+    return ret_pkt->raw_size();
+}
+
+// When the client's prefix is over its rate for this class of response,
+// returns what to send instead: nothing, or on every slip-th time a
+// truncated reply. TCP clients have completed a handshake, so they can't
+// be spoofed and are never limited.
+auto Server::limit(Worker& worker, const PacketView& query,
+                   const Client& client, ResponseClass response, uint8_t* out,
+                   size_t size) -> std::optional<size_t> {
+    if (!this->rate_limiter || client.stream != 0 ||
+        this->rate_limiter->allow(client.addr.sin_addr.s_addr, response,
+                                  client.received)) {
         return {};
     }
-    spdlog::debug("after receive");
 
-    // return packet
-    return std::move(data->first);
+    size_t slip = this->rate_limiter->slip;
+    if (slip > 0 && ++worker.limited % slip == 0) {
+        worker.metrics->slipped.add();
+        return write_question_only(query, true, out, size);
+    }
+    worker.metrics->rate_limited.add();
+    return 0;
 }
 
-auto Server::send(int sock_fd, const std::unique_ptr<uint8_t[]>& pkt,
-                  size_t nbytes, sockaddr_in sin)
-    -> std::optional<ErrorMessage> {
-    int ret = sendto(sock_fd, pkt.get(), nbytes, 0,
-                     reinterpret_cast<sockaddr*>(&sin), sizeof(sin));
+auto Server::reply(Worker& worker, const Client& client, const uint8_t* pkt,
+                   size_t nbytes) -> std::optional<ErrorMessage> {
+    if (client.stream == 0) {
+        if (worker.ring != nullptr &&
+            worker.ring->send(worker.client_sock, pkt, nbytes, client.addr)) {
+            return {};
+        }
+        auto error = this->send(worker.client_sock, pkt, nbytes, client.addr);
+        if (error) {
+            worker.metrics->drop(Drop::SendFailed);
+        }
+        return error;
+    }
+
+    Connection* conn = worker.streams.find(client.stream);
+    if (conn == nullptr) {
+        worker.metrics->drop(Drop::SendFailed);
+        return "TCP client already gone";
+    }
+
+    if (!worker.streams.queue(*conn, pkt, nbytes) ||
+        !worker.streams.flush(worker.epoll_fd, client.stream, *conn)) {
+        worker.metrics->drop(Drop::SendFailed);
+        worker.streams.close(worker.epoll_fd, client.stream);
+        return "TCP client stopped reading";
+    }
+    return {};
+}
+
+auto Server::send(int sock_fd, const uint8_t* pkt, size_t nbytes,
+                  const sockaddr_in& sin) -> std::optional<ErrorMessage> {
+    int ret = sendto(sock_fd, pkt, nbytes, 0,
+                     reinterpret_cast<const sockaddr*>(&sin), sizeof(sin));
 
     if (ret < 0) {
         return strerror(errno);
     }
 
     return {};
-}
\ No newline at end of file
+}
@@ -0,0 +1,60 @@
+#include "snapshot.hpp"
+
+#include <algorithm>
+
+#include "spdlog/spdlog.h"
+
+auto Snapshot::render(
+    const std::map<Record::Type, std::shared_ptr<QueryResponder>>& handlers)
+    -> void {
+    if (this->answers) {
+        return;
+    }
+
+    auto table = std::make_shared<AnswerTable>();
+    table->render(*this->collection, handlers);
+    this->answers = std::move(table);
+}
+
+SnapshotRcu::SnapshotRcu(size_t n_readers)
+    : readers(new Reader[n_readers]), n_readers(n_readers) {}
+
+auto SnapshotRcu::current() const -> const Snapshot* {
+    return this->snapshot.load(std::memory_order_acquire);
+}
+
+auto SnapshotRcu::quiesce(size_t reader) -> void {
+    this->readers[reader].seen.store(
+        this->generation.load(std::memory_order_acquire),
+        std::memory_order_release);
+}
+
+auto SnapshotRcu::publish(std::unique_ptr<Snapshot> next) -> void {
+    std::lock_guard<std::mutex> lock(this->publishing);
+
+    this->snapshot.store(next.get(), std::memory_order_release);
+    uint64_t target =
+        this->generation.fetch_add(1, std::memory_order_acq_rel) + 1;
+
+    if (this->owned) {
+        this->retired.push_back(Retired{target, std::move(this->owned)});
+    }
+    this->owned = std::move(next);
+}
+
+auto SnapshotRcu::reclaim() -> void {
+    std::lock_guard<std::mutex> lock(this->publishing);
+
+    uint64_t oldest = UINT64_MAX;
+    for (size_t i = 0; i < this->n_readers; i++) {
+        oldest = std::min(
+            oldest, this->readers[i].seen.load(std::memory_order_acquire));
+    }
+
+    // Retired snapshots are in publish order, so the freeable ones lead.
+    auto it = this->retired.begin();
+    while (it != this->retired.end() && it->generation <= oldest) {
+        it++;
+    }
+    this->retired.erase(this->retired.begin(), it);
+}
@@ -18,7 +18,6 @@ auto NotFoundResponder::response(const Collection& collection,
 
     // Question
     auto query = Query::from_binary(packet.payload, packet.plen);
-    auto query_raw = query.raw();
 
     // Answer
     auto domain_raw = collection.search_domain(query.qname);
@@ -31,35 +30,12 @@ auto NotFoundResponder::response(const Collection& collection,
         return {};
     }
 
-    Record SOA_record = SOA_records[0];
-    std::vector<uint8_t> domain = compress_domain(domain_raw.value());
-    std::vector<uint8_t> ns = compress_domain(SOA_record.r_rdata[0]);
-    std::vector<uint8_t> mbox = compress_domain(SOA_record.r_rdata[1]);
-
-    RecordParmas record_params = {
-        .r_type = htons(SOA_record.r_type),
-        .r_class = htons(SOA_record.r_class),
-        .r_ttl = htonl(SOA_record.r_ttl),
-        .r_rdlength = htons(ns.size() + mbox.size() + 20),
-        // 20 is the size of the rest of the rdata
-    };
-
     // Build the packet
-    PacketBuilder builder{};
-
-    builder.write(&header, sizeof(header))
-        .write(query_raw.get(), query.raw_size())
-        .write(domain.data(), domain.size())
-        .write(&record_params, sizeof(record_params))
-        .write(ns.data(), ns.size())
-        .write(mbox.data(), mbox.size());
-
-    for (int i = 2; i < SOA_record.r_rdata.size(); i++) {
-        uint32_t data = htonl(std::stoi(SOA_record.r_rdata[i]));
-        builder.write(&data, sizeof(data));
-    }
-
-    return builder.create();
+    return ResponseWriter()
+        .write(&header, sizeof(header))
+        .question(query)
+        .record(domain_raw.value(), SOA_records[0])
+        .create();
 }
 
 auto ARecordResponder::response(const Collection& collection,
@@ -81,46 +57,18 @@ auto ARecordResponder::response(const Collection& collection,
     header.dns_qr = 1;
     header = Header::to_response(header);
 
-    auto query_raw = query.raw();
-
-    PacketBuilder builder{};
-
-    builder.write(&header, sizeof(header))
-        .write(query_raw.get(), query.raw_size());
-
-    for (auto record : A_records) {
-        std::vector<uint8_t> domain = compress_domain(query.qname);
-        in_addr_t address = inet_addr(record.r_rdata[0].c_str());
-
-        RecordParmas record_params = {
-            .r_type = htons(record.r_type),
-            .r_class = htons(record.r_class),
-            .r_ttl = htonl(record.r_ttl),
-            .r_rdlength = htons(sizeof(address)),
-        };
+    ResponseWriter writer{};
+    writer.write(&header, sizeof(header)).question(query);
 
-        builder.write(domain.data(), domain.size())
-            .write(&record_params, sizeof(record_params))
-            .write(&address, sizeof(address));
+    for (const auto& record : A_records) {
+        writer.record(query.qname, record);
     }
 
-    for (auto record : NS_records) {
-        std::vector<uint8_t> domain = compress_domain(domain_raw.value());
-        std::vector<uint8_t> ns = compress_domain(record.r_rdata[0]);
-
-        RecordParmas record_params = {
-            .r_type = htons(record.r_type),
-            .r_class = htons(record.r_class),
-            .r_ttl = htonl(record.r_ttl),
-            .r_rdlength = htons(ns.size()),
-        };
-
-        builder.write(domain.data(), domain.size())
-            .write(&record_params, sizeof(record_params))
-            .write(ns.data(), ns.size());
+    for (const auto& record : NS_records) {
+        writer.record(domain_raw.value(), record);
     }
 
-    return builder.create();
+    return writer.create();
 }
 
 auto NSRecordResponder::response(const Collection& collection,
@@ -137,31 +85,15 @@ auto NSRecordResponder::response(const Collection& collection,
     header.dns_qr = 1;
     header = Header::to_response(header);
 
-    auto query_raw = query.raw();
-
-    PacketBuilder builder{};
-
-    builder.write(&header, sizeof(header))
-        .write(query_raw.get(), query.raw_size());
+    ResponseWriter writer{};
+    writer.write(&header, sizeof(header)).question(query);
 
-    for (auto record : NS_records) {
-        std::vector<uint8_t> domain = compress_domain(query.qname);
-        std::vector<uint8_t> ns = compress_domain(record.r_rdata[0]);
-
-        RecordParmas record_params = {
-            .r_type = htons(record.r_type),
-            .r_class = htons(record.r_class),
-            .r_ttl = htonl(record.r_ttl),
-            .r_rdlength = htons(ns.size()),
-        };
-
-        builder.write(domain.data(), domain.size())
-            .write(&record_params, sizeof(record_params))
-            .write(ns.data(), ns.size());
+    for (const auto& record : NS_records) {
+        writer.record(query.qname, record);
     }
 
-    for (auto NS_record : NS_records) {
-        auto ns_name = NS_record.r_rdata[0];
+    for (const auto& NS_record : NS_records) {
+        const auto& ns_name = std::get<NameData>(NS_record.r_rdata).name;
         auto A_records =
             collection.search_records(ns_name, Record::A, Record::IN);
 
@@ -169,24 +101,10 @@ auto NSRecordResponder::response(const Collection& collection,
             continue;
         }
 
-        auto record = A_records[0];
-
-        std::vector<uint8_t> domain = compress_domain(ns_name);
-        in_addr_t address = inet_addr(record.r_rdata[0].c_str());
-
-        RecordParmas record_params = {
-            .r_type = htons(record.r_type),
-            .r_class = htons(record.r_class),
-            .r_ttl = htonl(record.r_ttl),
-            .r_rdlength = htons(sizeof(address)),
-        };
-
-        builder.write(domain.data(), domain.size())
-            .write(&record_params, sizeof(record_params))
-            .write(&address, sizeof(address));
+        writer.record(ns_name, A_records[0]);
     }
 
-    return builder.create();
+    return writer.create();
 }
 
 auto MXRecordResponder::response(const Collection& collection,
@@ -207,50 +125,19 @@ auto MXRecordResponder::response(const Collection& collection,
     header.dns_qr = 1;
     header = Header::to_response(header);
 
-    auto query_raw = query.raw();
-
-    PacketBuilder builder{};
-
-    builder.write(&header, sizeof(header))
-        .write(query_raw.get(), query.raw_size());
-
-    for (auto record : MX_records) {
-        std::vector<uint8_t> domain = compress_domain(query.qname);
-        std::vector<uint8_t> mx = compress_domain(record.r_rdata[1]);
-
-        RecordParmas record_params = {
-            .r_type = htons(record.r_type),
-            .r_class = htons(record.r_class),
-            .r_ttl = htonl(record.r_ttl),
-            .r_rdlength = htons(mx.size() + sizeof(uint16_t)),
-        };
-
-        uint16_t preference = htons(std::stoi(record.r_rdata[0]));
+    ResponseWriter writer{};
+    writer.write(&header, sizeof(header)).question(query);
 
-        builder.write(domain.data(), domain.size())
-            .write(&record_params, sizeof(record_params))
-            .write(&preference, sizeof(preference))
-            .write(mx.data(), mx.size());
+    for (const auto& record : MX_records) {
+        writer.record(query.qname, record);
     }
 
-    for (auto record : NS_records) {
-        std::vector<uint8_t> domain = compress_domain(query.qname);
-        std::vector<uint8_t> ns = compress_domain(record.r_rdata[0]);
-
-        RecordParmas record_params = {
-            .r_type = htons(record.r_type),
-            .r_class = htons(record.r_class),
-            .r_ttl = htonl(record.r_ttl),
-            .r_rdlength = htons(ns.size()),
-        };
-
-        builder.write(domain.data(), domain.size())
-            .write(&record_params, sizeof(record_params))
-            .write(ns.data(), ns.size());
+    for (const auto& record : NS_records) {
+        writer.record(query.qname, record);
     }
 
-    for (auto MX_record : MX_records) {
-        auto mx_name = MX_record.r_rdata[1];
+    for (const auto& MX_record : MX_records) {
+        const auto& mx_name = std::get<MXData>(MX_record.r_rdata).exchange;
         auto A_records =
             collection.search_records(mx_name, Record::A, Record::IN);
 
@@ -258,24 +145,10 @@ auto MXRecordResponder::response(const Collection& collection,
             continue;
         }
 
-        auto record = A_records[0];
-
-        std::vector<uint8_t> domain = compress_domain(mx_name);
-        in_addr_t address = inet_addr(record.r_rdata[0].c_str());
-
-        RecordParmas record_params = {
-            .r_type = htons(record.r_type),
-            .r_class = htons(record.r_class),
-            .r_ttl = htonl(record.r_ttl),
-            .r_rdlength = htons(sizeof(address)),
-        };
-
-        builder.write(domain.data(), domain.size())
-            .write(&record_params, sizeof(record_params))
-            .write(&address, sizeof(address));
+        writer.record(mx_name, A_records[0]);
     }
 
-    return builder.create();
+    return writer.create();
 }
 
 auto SOARecordResponder::response(const Collection& collection,
@@ -296,53 +169,18 @@ auto SOARecordResponder::response(const Collection& collection,
     header.dns_qr = 1;
     header = Header::to_response(header);
 
-    auto query_raw = query.raw();
-
-    PacketBuilder builder{};
-
-    builder.write(&header, sizeof(header))
-        .write(query_raw.get(), query.raw_size());
+    ResponseWriter writer{};
+    writer.write(&header, sizeof(header)).question(query);
 
-    for (auto record : SOA_records) {
-        std::vector<uint8_t> domain = compress_domain(query.qname);
-        std::vector<uint8_t> ns = compress_domain(record.r_rdata[0]);
-        std::vector<uint8_t> mbox = compress_domain(record.r_rdata[1]);
-
-        RecordParmas record_params = {
-            .r_type = htons(record.r_type),
-            .r_class = htons(record.r_class),
-            .r_ttl = htonl(record.r_ttl),
-            .r_rdlength = htons(ns.size() + mbox.size() + 20),
-        };
-
-        builder.write(domain.data(), domain.size())
-            .write(&record_params, sizeof(record_params))
-            .write(ns.data(), ns.size())
-            .write(mbox.data(), mbox.size());
-
-        for (int i = 2; i < record.r_rdata.size(); i++) {
-            uint32_t data = htonl(std::stoi(record.r_rdata[i]));
-            builder.write(&data, sizeof(data));
-        }
+    for (const auto& record : SOA_records) {
+        writer.record(query.qname, record);
     }
 
-    for (auto record : NS_records) {
-        std::vector<uint8_t> domain = compress_domain(query.qname);
-        std::vector<uint8_t> ns = compress_domain(record.r_rdata[0]);
-
-        RecordParmas record_params = {
-            .r_type = htons(record.r_type),
-            .r_class = htons(record.r_class),
-            .r_ttl = htonl(record.r_ttl),
-            .r_rdlength = htons(ns.size()),
-        };
-
-        builder.write(domain.data(), domain.size())
-            .write(&record_params, sizeof(record_params))
-            .write(ns.data(), ns.size());
+    for (const auto& record : NS_records) {
+        writer.record(query.qname, record);
     }
 
-    return builder.create();
+    return writer.create();
 }
 
 auto TXTRecordResponder::response(const Collection& collection,
@@ -359,32 +197,14 @@ auto TXTRecordResponder::response(const Collection& collection,
     header.dns_qr = 1;
     header = Header::to_response(header);
 
-    auto query_raw = query.raw();
-
-    PacketBuilder builder{};
+    ResponseWriter writer{};
+    writer.write(&header, sizeof(header)).question(query);
 
-    builder.write(&header, sizeof(header))
-        .write(query_raw.get(), query.raw_size());
-
-    for (auto record : TXT_records) {
-        std::vector<uint8_t> domain = compress_domain(query.qname);
-        std::string txt = record.r_rdata[0];
-        uint8_t txtlen = txt.size();
-
-        RecordParmas record_params = {
-            .r_type = htons(record.r_type),
-            .r_class = htons(record.r_class),
-            .r_ttl = htonl(record.r_ttl),
-            .r_rdlength = htons(txt.size() + 1),
-        };
-
-        builder.write(domain.data(), domain.size())
-            .write(&record_params, sizeof(record_params))
-            .write(&txtlen, sizeof(txtlen))
-            .write(txt.data(), txt.size());
+    for (const auto& record : TXT_records) {
+        writer.record(query.qname, record);
     }
 
-    return builder.create();
+    return writer.create();
 }
 
 auto AAAARecordResponder::response(const Collection& collection,
@@ -407,53 +227,18 @@ auto AAAARecordResponder::response(const Collection& collection,
     header.dns_qr = 1;
     header = Header::to_response(header);
 
-    auto query_raw = query.raw();
-
-    PacketBuilder builder{};
-
-    builder.write(&header, sizeof(header))
-        .write(query_raw.get(), query.raw_size());
-
-    for (auto record : AAAA_records) {
-        std::vector<uint8_t> domain = compress_domain(query.qname);
-        sockaddr_in6 sin6{};
-
-        if (inet_pton(AF_INET6, record.r_rdata[0].c_str(), &sin6.sin6_addr) <=
-            0) {
-            err_quit("IPv6 fail");
-        }
-
-        auto& address = sin6.sin6_addr.__u6_addr.__u6_addr8;
+    ResponseWriter writer{};
+    writer.write(&header, sizeof(header)).question(query);
 
-        RecordParmas record_params = {
-            .r_type = htons(record.r_type),
-            .r_class = htons(record.r_class),
-            .r_ttl = htonl(record.r_ttl),
-            .r_rdlength = htons(sizeof(address)),
-        };
-
-        builder.write(domain.data(), domain.size())
-            .write(&record_params, sizeof(record_params))
-            .write(&address, sizeof(address));
+    for (const auto& record : AAAA_records) {
+        writer.record(query.qname, record);
     }
 
-    for (auto record : NS_records) {
-        std::vector<uint8_t> domain = compress_domain(domain_raw.value());
-        std::vector<uint8_t> ns = compress_domain(record.r_rdata[0]);
-
-        RecordParmas record_params = {
-            .r_type = htons(record.r_type),
-            .r_class = htons(record.r_class),
-            .r_ttl = htonl(record.r_ttl),
-            .r_rdlength = htons(ns.size()),
-        };
-
-        builder.write(domain.data(), domain.size())
-            .write(&record_params, sizeof(record_params))
-            .write(ns.data(), ns.size());
+    for (const auto& record : NS_records) {
+        writer.record(domain_raw.value(), record);
     }
 
-    return builder.create();
+    return writer.create();
 }
 
 auto CNAMERecordResponder::response(const Collection& collection,
@@ -463,8 +248,6 @@ auto CNAMERecordResponder::response(const Collection& collection,
     auto CNAME_records =
         collection.search_records(query.qname, Record::CNAME, Record::IN);
 
-    auto domain_raw = collection.search_domain(query.qname);
-
     auto NS_records =
         collection.search_records(query.qname, Record::NS, Record::IN);
 
@@ -475,44 +258,16 @@ auto CNAMERecordResponder::response(const Collection& collection,
     header.dns_qr = 1;
     header = Header::to_response(header);
 
-    auto query_raw = query.raw();
+    ResponseWriter writer{};
+    writer.write(&header, sizeof(header)).question(query);
 
-    PacketBuilder builder{};
-
-    builder.write(&header, sizeof(header))
-        .write(query_raw.get(), query.raw_size());
-
-    for (auto record : CNAME_records) {
-        std::vector<uint8_t> domain = compress_domain(query.qname);
-        std::vector<uint8_t> cname = compress_domain(record.r_rdata[0]);
-
-        RecordParmas record_params = {
-            .r_type = htons(record.r_type),
-            .r_class = htons(record.r_class),
-            .r_ttl = htonl(record.r_ttl),
-            .r_rdlength = htons(cname.size()),
-        };
-
-        builder.write(domain.data(), domain.size())
-            .write(&record_params, sizeof(record_params))
-            .write(cname.data(), cname.size());
+    for (const auto& record : CNAME_records) {
+        writer.record(query.qname, record);
     }
 
-    for (auto record : NS_records) {
-        std::vector<uint8_t> domain = compress_domain(query.qname);
-        std::vector<uint8_t> ns = compress_domain(record.r_rdata[0]);
-
-        RecordParmas record_params = {
-            .r_type = htons(record.r_type),
-            .r_class = htons(record.r_class),
-            .r_ttl = htonl(record.r_ttl),
-            .r_rdlength = htons(ns.size()),
-        };
-
-        builder.write(domain.data(), domain.size())
-            .write(&record_params, sizeof(record_params))
-            .write(ns.data(), ns.size());
+    for (const auto& record : NS_records) {
+        writer.record(query.qname, record);
     }
 
-    return builder.create();
-}
\ No newline at end of file
+    return writer.create();
+}
@@ -0,0 +1,153 @@
+#include "stream.hpp"
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstring>
+
+#include "spdlog/spdlog.h"
+
+auto StreamTable::accept(int epoll_fd) -> void {
+    while (true) {
+        sockaddr_in peer{};
+        socklen_t peerlen = sizeof(peer);
+
+        int fd = accept4(this->listen_sock, reinterpret_cast<sockaddr*>(&peer),
+                         &peerlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                spdlog::warn("Accept failed: {}", strerror(errno));
+            }
+            return;
+        }
+
+        // Accept and close rather than leave clients queued in the backlog
+        // until they time out.
+        if (this->connections.size() >= this->max_connections) {
+            spdlog::debug("Refuse TCP client over the connection limit");
+            ::close(fd);
+            continue;
+        }
+
+        uint64_t id = this->next_id++;
+        epoll_event event{.events = EPOLLIN | EPOLLRDHUP, .data = {.u64 = id}};
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            spdlog::warn("Fail to watch TCP client: {}", strerror(errno));
+            ::close(fd);
+            continue;
+        }
+
+        this->connections.emplace(id, Connection{.fd = fd,
+                                                 .peer = peer,
+                                                 .last_active = Clock::now()});
+    }
+}
+
+auto StreamTable::find(uint64_t id) -> Connection* {
+    auto it = this->connections.find(id);
+    return it == this->connections.end() ? nullptr : &it->second;
+}
+
+auto StreamTable::read(Connection& conn) -> bool {
+    uint8_t buf[4096];
+
+    while (true) {
+        ssize_t ret = ::read(conn.fd, buf, sizeof(buf));
+        if (ret < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        if (ret == 0) {
+            conn.eof = true;
+            return true;
+        }
+
+        conn.in.insert(conn.in.end(), buf, buf + ret);
+        conn.last_active = Clock::now();
+
+        // A full message plus its length is the most a client may have
+        // outstanding in one read; more means it is not framing.
+        if (conn.in.size() > 2 * (TCP_MAX_MESSAGE + sizeof(uint16_t))) {
+            return false;
+        }
+    }
+}
+
+auto StreamTable::queue(Connection& conn, const uint8_t* msg, size_t len)
+    -> bool {
+    if (conn.out.size() - conn.sent + len > TCP_MAX_OUTPUT) {
+        return false;
+    }
+
+    uint16_t prefix = htons(len);
+    auto bytes = reinterpret_cast<const uint8_t*>(&prefix);
+    conn.out.insert(conn.out.end(), bytes, bytes + sizeof(prefix));
+    conn.out.insert(conn.out.end(), msg, msg + len);
+    return true;
+}
+
+auto StreamTable::flush(int epoll_fd, uint64_t id, Connection& conn) -> bool {
+    while (conn.sent < conn.out.size()) {
+        ssize_t ret = ::send(conn.fd, conn.out.data() + conn.sent,
+                             conn.out.size() - conn.sent, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return false;
+            }
+            break;
+        }
+        conn.sent += ret;
+        conn.last_active = Clock::now();
+    }
+
+    if (conn.sent == conn.out.size()) {
+        conn.out.clear();
+        conn.sent = 0;
+    }
+
+    // Only wait for writability while replies are stuck in `out`, and stop
+    // reading once the client has closed its side: the set is
+    // level-triggered, so a readable EOF would wake the worker until the
+    // connection is swept.
+    bool want_write = !conn.out.empty();
+    bool want_read = !conn.eof;
+    if (want_write != conn.want_write || want_read != conn.want_read) {
+        uint32_t events =
+            (want_read ? static_cast<uint32_t>(EPOLLIN | EPOLLRDHUP) : 0u) |
+            (want_write ? static_cast<uint32_t>(EPOLLOUT) : 0u);
+        epoll_event event{.events = events, .data = {.u64 = id}};
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn.fd, &event);
+        conn.want_write = want_write;
+        conn.want_read = want_read;
+    }
+    return true;
+}
+
+auto StreamTable::close(int epoll_fd, uint64_t id) -> void {
+    auto it = this->connections.find(id);
+    if (it == this->connections.end()) {
+        return;
+    }
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, it->second.fd, nullptr);
+    ::close(it->second.fd);
+    this->connections.erase(it);
+}
+
+auto StreamTable::sweep(int epoll_fd, Clock::time_point now) -> void {
+    std::vector<uint64_t> idle;
+    for (const auto& [id, conn] : this->connections) {
+        // A client that closed its side may still be owed forwarded
+        // answers, so it lingers until those have timed out.
+        auto timeout = conn.eof ? std::chrono::duration_cast<Clock::duration>(
+                                      FORWARD_TIMEOUT)
+                                : TCP_IDLE_TIMEOUT;
+        if (now - conn.last_active >= timeout) {
+            idle.push_back(id);
+        }
+    }
+
+    for (auto id : idle) {
+        this->close(epoll_fd, id);
+    }
+}
@@ -0,0 +1,804 @@
+#include "update.hpp"
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <optional>
+#include <set>
+#include <string>
+
+#include "forwarder.hpp"
+#include "spdlog/spdlog.h"
+
+constexpr uint16_t TYPE_ANY = 255;
+constexpr uint16_t CLASS_NONE = 254;
+constexpr uint16_t CLASS_ANY = 255;
+constexpr int MAX_POINTERS = 16;
+
+constexpr std::array<uint16_t, 7> KNOWN_TYPES = {
+    Record::A,  Record::NS,  Record::CNAME, Record::SOA,
+    Record::MX, Record::TXT, Record::AAAA,
+};
+
+// A resource record of the prerequisite or update section, with its rdata
+// left in the message until it is needed.
+struct WireRecord {
+    std::string name;
+    uint16_t r_type;
+    uint16_t r_class;
+    uint32_t r_ttl;
+    uint16_t rdlength;
+    size_t rdata;
+};
+
+// Reads a possibly compressed name into the dotted form the collection
+// uses. `cursor` moves past the name as it appears at its position.
+static auto read_name(const uint8_t* data, size_t len, size_t& cursor)
+    -> std::optional<std::string> {
+    std::string name;
+    size_t at = cursor;
+    bool jumped = false;
+
+    for (int jumps = 0; jumps <= MAX_POINTERS;) {
+        if (at >= len) {
+            return {};
+        }
+
+        uint8_t label_len = data[at];
+        if ((label_len & 0xc0) == 0xc0) {
+            if (at + 1 >= len) {
+                return {};
+            }
+            if (!jumped) {
+                cursor = at + 2;
+                jumped = true;
+            }
+            at = (label_len & 0x3f) << 8 | data[at + 1];
+            jumps++;
+            continue;
+        }
+
+        if ((label_len & 0xc0) != 0 || at + 1 + label_len > len) {
+            return {};
+        }
+
+        if (label_len == 0) {
+            if (!jumped) {
+                cursor = at + 1;
+            }
+            return name;
+        }
+
+        name.append(reinterpret_cast<const char*>(data + at + 1), label_len);
+        name.push_back('.');
+        if (name.size() > MAX_NAME_SIZE) {
+            return {};
+        }
+        at += label_len + 1;
+    }
+
+    return {};
+}
+
+static auto read_record(const uint8_t* data, size_t len, size_t& cursor)
+    -> std::optional<WireRecord> {
+    auto name = read_name(data, len, cursor);
+    if (!name || cursor + sizeof(RecordParmas) > len) {
+        return {};
+    }
+
+    RecordParmas params;
+    std::copy_n(data + cursor, sizeof(params),
+                reinterpret_cast<uint8_t*>(&params));
+    cursor += sizeof(params);
+
+    WireRecord record{
+        .name = std::move(*name),
+        .r_type = ntohs(params.r_type),
+        .r_class = ntohs(params.r_class),
+        .r_ttl = ntohl(params.r_ttl),
+        .rdlength = ntohs(params.r_rdlength),
+        .rdata = cursor,
+    };
+
+    if (cursor + record.rdlength > len) {
+        return {};
+    }
+    cursor += record.rdlength;
+    return record;
+}
+
+// Decodes rdata into the same form RecordBuilder produces from zone files.
+static auto read_rdata(const uint8_t* data, size_t len,
+                       const WireRecord& record) -> std::optional<RData> {
+    size_t cursor = record.rdata;
+    size_t end = record.rdata + record.rdlength;
+
+    auto read_u32 = [&](uint32_t& out) {
+        if (cursor + sizeof(out) > end) {
+            return false;
+        }
+        std::copy_n(data + cursor, sizeof(out),
+                    reinterpret_cast<uint8_t*>(&out));
+        cursor += sizeof(out);
+        return true;
+    };
+
+    switch (record.r_type) {
+        case Record::A: {
+            AData a;
+            if (record.rdlength != sizeof(a.address)) {
+                return {};
+            }
+            std::copy_n(data + cursor, sizeof(a.address),
+                        reinterpret_cast<uint8_t*>(&a.address));
+            return a;
+        }
+        case Record::AAAA: {
+            AAAAData aaaa;
+            if (record.rdlength != sizeof(aaaa.address)) {
+                return {};
+            }
+            std::copy_n(data + cursor, sizeof(aaaa.address),
+                        reinterpret_cast<uint8_t*>(&aaaa.address));
+            return aaaa;
+        }
+        case Record::NS:
+        case Record::CNAME: {
+            auto name = read_name(data, len, cursor);
+            if (!name || cursor != end) {
+                return {};
+            }
+            return NameData{std::move(*name)};
+        }
+        case Record::MX: {
+            MXData mx;
+            if (record.rdlength < sizeof(mx.preference)) {
+                return {};
+            }
+            std::copy_n(data + cursor, sizeof(mx.preference),
+                        reinterpret_cast<uint8_t*>(&mx.preference));
+            cursor += sizeof(mx.preference);
+
+            auto exchange = read_name(data, len, cursor);
+            if (!exchange || cursor != end) {
+                return {};
+            }
+            mx.exchange = std::move(*exchange);
+            return mx;
+        }
+        case Record::SOA: {
+            SOAData soa;
+            auto mname = read_name(data, len, cursor);
+            auto rname = read_name(data, len, cursor);
+            if (!mname || !rname || !read_u32(soa.serial) ||
+                !read_u32(soa.refresh) || !read_u32(soa.retry) ||
+                !read_u32(soa.expire) || !read_u32(soa.minimum) ||
+                cursor != end) {
+                return {};
+            }
+            soa.mname = std::move(*mname);
+            soa.rname = std::move(*rname);
+            return soa;
+        }
+        case Record::TXT: {
+            // Zone files hold one string, so several are joined by spaces.
+            TXTData txt;
+            while (cursor < end) {
+                uint8_t txtlen = data[cursor++];
+                if (cursor + txtlen > end) {
+                    return {};
+                }
+                if (!txt.text.empty()) {
+                    txt.text.push_back(' ');
+                }
+                txt.text.append(reinterpret_cast<const char*>(data + cursor),
+                                txtlen);
+                cursor += txtlen;
+            }
+            if (txt.text.size() > UINT8_MAX) {
+                return {};
+            }
+            return txt;
+        }
+    }
+    return {};
+}
+
+static auto same_rdata(const RData& a, const RData& b) -> bool {
+    if (a.index() != b.index()) {
+        return false;
+    }
+
+    if (auto x = std::get_if<AData>(&a)) {
+        return std::memcmp(&x->address, &std::get<AData>(b).address,
+                           sizeof(x->address)) == 0;
+    }
+    if (auto x = std::get_if<AAAAData>(&a)) {
+        return std::memcmp(&x->address, &std::get<AAAAData>(b).address,
+                           sizeof(x->address)) == 0;
+    }
+    if (auto x = std::get_if<NameData>(&a)) {
+        return x->name == std::get<NameData>(b).name;
+    }
+    if (auto x = std::get_if<MXData>(&a)) {
+        const auto& y = std::get<MXData>(b);
+        return x->preference == y.preference && x->exchange == y.exchange;
+    }
+    if (auto x = std::get_if<SOAData>(&a)) {
+        const auto& y = std::get<SOAData>(b);
+        return x->mname == y.mname && x->rname == y.rname &&
+               x->serial == y.serial && x->refresh == y.refresh &&
+               x->retry == y.retry && x->expire == y.expire &&
+               x->minimum == y.minimum;
+    }
+    return std::get<TXTData>(a).text == std::get<TXTData>(b).text;
+}
+
+static auto is_known(uint16_t r_type) -> bool {
+    return std::find(KNOWN_TYPES.begin(), KNOWN_TYPES.end(), r_type) !=
+           KNOWN_TYPES.end();
+}
+
+static auto records_of(const Collection& collection, const std::string& owner,
+                       uint16_t r_type) -> std::vector<Record> {
+    auto span = collection.search_records(owner, r_type, Record::IN);
+    return std::vector<Record>(span.begin(), span.end());
+}
+
+static auto name_in_use(const Collection& collection, const std::string& name)
+    -> bool {
+    return std::any_of(KNOWN_TYPES.begin(), KNOWN_TYPES.end(), [&](auto t) {
+        return !collection.search_records(name, t, Record::IN).empty();
+    });
+}
+
+// Records keep their owner relative to the zone, as in zone files.
+static auto relative_name(const std::string& owner, const std::string& zone)
+    -> std::string {
+    if (owner == zone) {
+        return "@";
+    }
+    return owner.substr(0, owner.size() - zone.size() - 1);
+}
+
+auto Updater::reply(const PacketView& message, uint8_t rcode, uint8_t* out,
+                    size_t size) -> size_t {
+    if (message.question_end > size) {
+        return 0;
+    }
+
+    Header header = message.header;
+    header.dns_qr = 1;
+    header.dns_rcode = rcode;
+    header.dns_qdcount = 1;
+    header.dns_ancount = 0;
+    header.dns_nscount = 0;
+    header.dns_arcount = 0;
+    header = Header::to_response(header);
+
+    std::copy_n(reinterpret_cast<uint8_t*>(&header), sizeof(header), out);
+    std::copy(message.data + sizeof(header),
+              message.data + message.question_end, out + sizeof(header));
+    return message.question_end;
+}
+
+Updater::Updater(
+    std::shared_ptr<SnapshotRcu> snapshots, ZoneLoader loader,
+    std::map<Record::Type, std::shared_ptr<QueryResponder>> handlers,
+    std::vector<in_addr_t> allowed)
+    : snapshots(std::move(snapshots)),
+      loader(std::move(loader)),
+      handlers(std::move(handlers)),
+      allowed(std::move(allowed)) {}
+
+auto UpdateReplies::post(uint64_t stream, std::vector<uint8_t> reply)
+    -> void {
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->replies.emplace_back(stream, std::move(reply));
+    }
+
+    uint64_t one = 1;
+    if (::write(this->event, &one, sizeof(one)) < 0) {
+        spdlog::warn("Fail to wake worker for update reply: {}",
+                     strerror(errno));
+    }
+}
+
+auto UpdateReplies::take()
+    -> std::vector<std::pair<uint64_t, std::vector<uint8_t>>> {
+    uint64_t count;
+    ::read(this->event, &count, sizeof(count));
+
+    std::vector<std::pair<uint64_t, std::vector<uint8_t>>> taken;
+    std::lock_guard<std::mutex> guard(this->lock);
+    taken.swap(this->replies);
+    return taken;
+}
+
+auto Updater::submit(const PacketView& message, const UpdateOrigin& origin,
+                     uint8_t* out, size_t size) -> size_t {
+    if (std::find(this->allowed.begin(), this->allowed.end(),
+                  origin.client.sin_addr.s_addr) == this->allowed.end()) {
+        return reply(message, REFUSED, out, size);
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        if (this->pending.size() >= MAX_PENDING_UPDATES) {
+            return reply(message, SERVFAIL, out, size);
+        }
+        this->pending.push_back(UpdateRequest{
+            .message = std::vector<uint8_t>(message.data,
+                                            message.data + message.len),
+            .origin = origin,
+        });
+    }
+
+    this->wakeup.notify_one();
+    return 0;
+}
+
+auto Updater::request_reload() -> void {
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->reload_pending = true;
+    }
+    this->wakeup.notify_one();
+}
+
+auto Updater::run() -> void {
+    auto last_report = Clock::now();
+
+    while (true) {
+        std::vector<UpdateRequest> batch;
+        bool reload = false;
+        {
+            std::unique_lock<std::mutex> guard(this->lock);
+            this->wakeup.wait_for(guard, RECLAIM_INTERVAL, [this] {
+                return !this->pending.empty() || this->reload_pending;
+            });
+            batch.swap(this->pending);
+            std::swap(reload, this->reload_pending);
+        }
+
+        if (reload) {
+            this->reload();
+        }
+
+        if (!batch.empty()) {
+            this->apply_batch(batch);
+        }
+
+        this->snapshots->reclaim();
+
+        auto now = Clock::now();
+        if (this->n_batches > 0 &&
+            now - last_report >= UPDATE_REPORT_INTERVAL) {
+            spdlog::info("Applied {} updates, rejected {}, in {} batches",
+                         this->n_applied, this->n_rejected, this->n_batches);
+            this->n_applied = this->n_rejected = this->n_batches = 0;
+            last_report = now;
+        }
+    }
+}
+
+auto Updater::reload() -> void {
+    auto start = Clock::now();
+    auto next = this->loader.load();
+    if (!next) {
+        spdlog::error("Reload failed, keep serving the current zones");
+        return;
+    }
+
+    if (next->forward_ip != this->snapshots->current()->forward_ip) {
+        spdlog::warn("Forward ip changes only take effect on restart");
+    }
+
+    next->render(this->handlers);
+    this->snapshots->publish(std::move(next));
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        Clock::now() - start);
+    spdlog::info("Reloaded zones in {} ms", elapsed.count());
+}
+
+auto Updater::apply_batch(std::vector<UpdateRequest>& batch) -> void {
+    // Only this thread publishes or reclaims, so the current snapshot stays
+    // alive while the draft is built on top of it.
+    const Snapshot* current = this->snapshots->current();
+    auto table = std::dynamic_pointer_cast<const AnswerTable>(current->answers);
+
+    std::vector<uint8_t> rcodes(batch.size(), NOTIMP);
+    bool changed = false;
+
+    if (current->collection && table) {
+        UpdateDraft draft{
+            .collection =
+                current->collection->base
+                    ? std::make_shared<Collection>(*current->collection)
+                    : std::make_shared<Collection>(current->collection),
+            .answers = table->base ? std::make_shared<AnswerTable>(*table)
+                                   : std::make_shared<AnswerTable>(table),
+        };
+
+        for (size_t i = 0; i < batch.size(); i++) {
+            const auto& message = batch[i].message;
+            auto view = PacketView::parse(message.data(), message.size());
+            rcodes[i] = view ? this->apply(draft, *view)
+                             : static_cast<uint8_t>(FORMERR);
+            changed |= rcodes[i] == NOERROR;
+        }
+
+        if (changed) {
+            // Fold the layers into a new base once they grow, so lookups
+            // and the next draft copy stay cheap.
+            if (draft.collection->rrsets.size() > COMPACT_THRESHOLD) {
+                draft.collection =
+                    std::make_shared<Collection>(draft.collection->flatten());
+                draft.answers =
+                    std::make_shared<AnswerTable>(draft.answers->flatten());
+            }
+
+            auto next = std::make_unique<Snapshot>();
+            next->forward_ip = current->forward_ip;
+            next->collection = std::move(draft.collection);
+            next->answers = std::move(draft.answers);
+            this->snapshots->publish(std::move(next));
+        }
+    }
+
+    for (size_t i = 0; i < batch.size(); i++) {
+        const auto& request = batch[i];
+        auto view =
+            PacketView::parse(request.message.data(), request.message.size());
+        if (!view) {
+            continue;
+        }
+
+        uint8_t reply[PACKET_SIZE];
+        size_t len = Updater::reply(*view, rcodes[i], reply, sizeof(reply));
+        const auto& origin = request.origin;
+        if (origin.stream != 0) {
+            origin.replies->post(origin.stream,
+                                 std::vector<uint8_t>(reply, reply + len));
+        } else if (sendto(origin.sock, reply, len, 0,
+                          reinterpret_cast<const sockaddr*>(&origin.client),
+                          sizeof(origin.client)) < 0) {
+            spdlog::warn("Fail to send update response: {}", strerror(errno));
+        }
+
+        if (rcodes[i] == NOERROR) {
+            this->n_applied++;
+        } else {
+            this->n_rejected++;
+        }
+    }
+    this->n_batches++;
+}
+
+auto Updater::apply(UpdateDraft& draft, const PacketView& message)
+    -> uint8_t {
+    Collection& collection = *draft.collection;
+    const uint8_t* data = message.data;
+    size_t len = message.len;
+
+    // Zone section (RFC 2136 3.1)
+    if (message.header.dns_qdcount != 1 || message.qtype != Record::SOA) {
+        return FORMERR;
+    }
+
+    std::string zone(message.qname());
+    auto enclosing = collection.search_domain(zone);
+    if (message.qclass != Record::IN || !enclosing || *enclosing != zone) {
+        return NOTAUTH;
+    }
+
+    auto in_zone = [&](const std::string& name) {
+        auto found = collection.search_domain(name);
+        return found && *found == zone;
+    };
+
+    size_t cursor = message.question_end;
+    std::vector<WireRecord> prerequisites, updates;
+    for (size_t i = 0; i < message.header.dns_ancount; i++) {
+        auto record = read_record(data, len, cursor);
+        if (!record) {
+            return FORMERR;
+        }
+        prerequisites.push_back(std::move(*record));
+    }
+    for (size_t i = 0; i < message.header.dns_nscount; i++) {
+        auto record = read_record(data, len, cursor);
+        if (!record) {
+            return FORMERR;
+        }
+        updates.push_back(std::move(*record));
+    }
+
+    // Prerequisites (RFC 2136 3.2)
+    std::map<std::pair<std::string, uint16_t>, std::vector<RData>> expected;
+    for (const auto& pr : prerequisites) {
+        if (pr.r_ttl != 0) {
+            return FORMERR;
+        }
+        if (!in_zone(pr.name)) {
+            return NOTZONE;
+        }
+
+        if (pr.r_class == CLASS_ANY || pr.r_class == CLASS_NONE) {
+            if (pr.rdlength != 0) {
+                return FORMERR;
+            }
+
+            bool exists =
+                pr.r_type == TYPE_ANY
+                    ? name_in_use(collection, pr.name)
+                    : !collection.search_records(pr.name, pr.r_type,
+                                                 Record::IN)
+                           .empty();
+
+            if (pr.r_class == CLASS_ANY && !exists) {
+                return pr.r_type == TYPE_ANY ? NXDOMAIN : NXRRSET;
+            }
+            if (pr.r_class == CLASS_NONE && exists) {
+                return pr.r_type == TYPE_ANY ? YXDOMAIN : YXRRSET;
+            }
+        } else if (pr.r_class == Record::IN) {
+            auto rdata = read_rdata(data, len, pr);
+            if (!rdata) {
+                return pr.r_type == TYPE_ANY || is_known(pr.r_type) ? FORMERR
+                                                                    : NXRRSET;
+            }
+            expected[{pr.name, pr.r_type}].push_back(std::move(*rdata));
+        } else {
+            return FORMERR;
+        }
+    }
+
+    for (const auto& [key, rdatas] : expected) {
+        auto records = collection.search_records(key.first, key.second,
+                                                 Record::IN);
+        bool equal =
+            records.size() == rdatas.size() &&
+            std::all_of(records.begin(), records.end(), [&](const auto& r) {
+                return std::any_of(rdatas.begin(), rdatas.end(),
+                                   [&](const auto& rdata) {
+                                       return same_rdata(r.r_rdata, rdata);
+                                   });
+            });
+        if (!equal) {
+            return NXRRSET;
+        }
+    }
+
+    // Prescan (RFC 2136 3.4.1), so a rejected update changes nothing.
+    std::vector<std::optional<RData>> rdatas;
+    for (const auto& up : updates) {
+        if (!in_zone(up.name)) {
+            return NOTZONE;
+        }
+
+        if (up.r_class == Record::IN) {
+            if (!is_known(up.r_type)) {
+                return up.r_type >= 128 ? FORMERR : NOTIMP;
+            }
+            auto rdata = read_rdata(data, len, up);
+            if (!rdata) {
+                return FORMERR;
+            }
+            rdatas.push_back(std::move(rdata));
+        } else if (up.r_class == CLASS_ANY) {
+            if (up.r_ttl != 0 || up.rdlength != 0) {
+                return FORMERR;
+            }
+            rdatas.push_back(std::nullopt);
+        } else if (up.r_class == CLASS_NONE) {
+            if (up.r_ttl != 0 || up.r_type == TYPE_ANY) {
+                return FORMERR;
+            }
+            rdatas.push_back(read_rdata(data, len, up));
+        } else {
+            return FORMERR;
+        }
+    }
+
+    // Update (RFC 2136 3.4.2)
+    std::vector<std::pair<std::string, uint16_t>> touched;
+    bool serial_set = false;
+
+    auto store = [&](const std::string& owner, uint16_t r_type,
+                     std::vector<Record> records) {
+        collection.replace(RRset{
+            .owner = owner,
+            .r_type = r_type,
+            .r_class = Record::IN,
+            .records = std::move(records),
+        });
+        touched.emplace_back(owner, r_type);
+    };
+
+    for (size_t i = 0; i < updates.size(); i++) {
+        const auto& up = updates[i];
+        bool apex = up.name == zone;
+
+        if (up.r_class == Record::IN) {
+            auto records = records_of(collection, up.name, up.r_type);
+            Record record{
+                .r_name = relative_name(up.name, zone),
+                .r_type = up.r_type,
+                .r_class = Record::IN,
+                .r_ttl = up.r_ttl,
+                .r_rdlength = up.rdlength,
+                .r_rdata = std::move(*rdatas[i]),
+            };
+
+            if (up.r_type == Record::SOA) {
+                // Only a newer serial replaces the SOA (RFC 1982 order).
+                if (!apex || records.empty() ||
+                    static_cast<int32_t>(
+                        ntohl(std::get<SOAData>(record.r_rdata).serial) -
+                        ntohl(std::get<SOAData>(records[0].r_rdata).serial)) <=
+                        0) {
+                    continue;
+                }
+                store(up.name, up.r_type, {std::move(record)});
+                serial_set = true;
+                continue;
+            }
+
+            bool has_cname =
+                !collection.search_records(up.name, Record::CNAME, Record::IN)
+                     .empty();
+            if (up.r_type == Record::CNAME
+                    ? name_in_use(collection, up.name) && !has_cname
+                    : has_cname) {
+                continue;
+            }
+
+            auto duplicate =
+                std::find_if(records.begin(), records.end(), [&](auto& r) {
+                    return same_rdata(r.r_rdata, record.r_rdata);
+                });
+            if (duplicate != records.end()) {
+                continue;
+            }
+
+            if (up.r_type == Record::CNAME) {
+                records.clear();
+            }
+            records.push_back(std::move(record));
+            store(up.name, up.r_type, std::move(records));
+        } else if (up.r_class == CLASS_ANY) {
+            for (auto r_type : KNOWN_TYPES) {
+                if (up.r_type != TYPE_ANY && up.r_type != r_type) {
+                    continue;
+                }
+                if (apex && (r_type == Record::SOA || r_type == Record::NS)) {
+                    continue;
+                }
+                if (!collection.search_records(up.name, r_type, Record::IN)
+                         .empty()) {
+                    store(up.name, r_type, {});
+                }
+            }
+        } else if (rdatas[i] && up.r_type != Record::SOA) {
+            auto records = records_of(collection, up.name, up.r_type);
+            auto removed = std::remove_if(
+                records.begin(), records.end(), [&](const auto& r) {
+                    return same_rdata(r.r_rdata, *rdatas[i]);
+                });
+            bool last_ns = apex && up.r_type == Record::NS &&
+                           removed == records.begin();
+            if (removed == records.end() || last_ns) {
+                continue;
+            }
+            records.erase(removed, records.end());
+            store(up.name, up.r_type, std::move(records));
+        }
+    }
+
+    if (touched.empty()) {
+        return NOERROR;
+    }
+
+    // The serial moves with every change unless the update set it
+    // (RFC 2136 3.6).
+    if (!serial_set) {
+        auto soa = records_of(collection, zone, Record::SOA);
+        if (!soa.empty()) {
+            auto& serial = std::get<SOAData>(soa[0].r_rdata).serial;
+            serial = htonl(ntohl(serial) + 1);
+            store(zone, Record::SOA, std::move(soa));
+        }
+    }
+
+    this->rerender(draft, zone, touched);
+    return NOERROR;
+}
+
+// Renders again every answer that embeds a changed RRset: the RRset's own
+// answer, the zone's not-found answer for the SOA, every NS and MX answer
+// that carries a changed A RRset as additional data, and every answer of an
+// owner whose NS changed. A change to the apex NS renders the whole zone,
+// since A and AAAA answers carry it.
+auto Updater::rerender(
+    UpdateDraft& draft, const std::string& zone,
+    const std::vector<std::pair<std::string, uint16_t>>& touched) -> void {
+    const Collection& collection = *draft.collection;
+    AnswerTable& answers = *draft.answers;
+    std::set<std::pair<std::string, uint16_t>> pending;
+    std::set<std::string> glue;
+    bool apex_ns = false;
+
+    for (const auto& [owner, r_type] : touched) {
+        pending.emplace(owner, r_type);
+
+        if (r_type == Record::SOA) {
+            answers.rerender_missing(collection, zone);
+        } else if (r_type == Record::A) {
+            glue.insert(owner);
+        } else if (r_type == Record::NS) {
+            apex_ns |= owner == zone;
+            for (auto other : KNOWN_TYPES) {
+                pending.emplace(owner, other);
+            }
+        }
+    }
+
+    // NS and MX targets may sit in any zone, so every NS and MX RRset is
+    // checked; one shadowed by the layer only costs a spare render.
+    if (!glue.empty()) {
+        auto add_referrers = [&](const std::vector<RRset>& rrsets) {
+            for (const auto& rrset : rrsets) {
+                if (rrset.r_class != Record::IN ||
+                    (rrset.r_type != Record::NS &&
+                     rrset.r_type != Record::MX)) {
+                    continue;
+                }
+                for (const auto& record : rrset.records) {
+                    const auto& target =
+                        rrset.r_type == Record::NS
+                            ? std::get<NameData>(record.r_rdata).name
+                            : std::get<MXData>(record.r_rdata).exchange;
+                    if (glue.count(target)) {
+                        pending.emplace(rrset.owner, rrset.r_type);
+                        break;
+                    }
+                }
+            }
+        };
+        if (collection.base) {
+            add_referrers(collection.base->rrsets);
+        }
+        add_referrers(collection.rrsets);
+    }
+
+    if (apex_ns) {
+        auto add_zone = [&](const std::vector<RRset>& rrsets) {
+            for (const auto& rrset : rrsets) {
+                auto found = collection.search_domain(rrset.owner);
+                if (rrset.r_class == Record::IN && found && *found == zone) {
+                    pending.emplace(rrset.owner, rrset.r_type);
+                }
+            }
+        };
+        if (collection.base) {
+            add_zone(collection.base->rrsets);
+        }
+        add_zone(collection.rrsets);
+    }
+
+    for (const auto& [owner, r_type] : pending) {
+        // Types never stored at the owner need no tombstone either.
+        if (collection.search_records(owner, r_type, Record::IN).empty() &&
+            !answers.find(owner, r_type)) {
+            continue;
+        }
+        answers.rerender(collection, this->handlers, owner, r_type);
+    }
+}
@@ -0,0 +1,290 @@
+#include "uring.hpp"
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstring>
+
+#include "spdlog/spdlog.h"
+
+// Each provided buffer takes the recvmsg header, the sender and a message.
+constexpr size_t RING_BUFFER_SIZE =
+    sizeof(io_uring_recvmsg_out) + sizeof(sockaddr_in) + PACKET_SIZE;
+
+auto IoRing::create(unsigned entries) -> std::unique_ptr<IoRing> {
+    // Only the worker that owns the ring submits to it, so the kernel may
+    // defer completion work until that worker waits.
+    io_uring_params params{};
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0 && errno == EINVAL) {
+        params = {};
+        fd = syscall(__NR_io_uring_setup, entries, &params);
+    }
+    if (fd < 0) {
+        spdlog::warn("Fail to set up io_uring: {}", strerror(errno));
+        return nullptr;
+    }
+
+    std::unique_ptr<IoRing> ring(new IoRing());
+    ring->fd = fd;
+
+    constexpr unsigned required = IORING_FEAT_SINGLE_MMAP |
+                                  IORING_FEAT_EXT_ARG | IORING_FEAT_NODROP;
+    if ((params.features & required) != required) {
+        spdlog::warn("io_uring lacks features {:#x}",
+                     required & ~params.features);
+        return nullptr;
+    }
+
+    // One mapping holds both rings, with the submission entries apart.
+    ring->sq_map_len =
+        std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                 params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+    ring->sq_map = mmap(nullptr, ring->sq_map_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->sqes_len = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, ring->sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sq_map == MAP_FAILED || sqes == MAP_FAILED) {
+        spdlog::warn("Fail to map io_uring: {}", strerror(errno));
+        ring->sq_map = ring->sq_map == MAP_FAILED ? nullptr : ring->sq_map;
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, ring->sqes_len);
+        }
+        return nullptr;
+    }
+    ring->sqes = static_cast<io_uring_sqe*>(sqes);
+
+    auto base = static_cast<uint8_t*>(ring->sq_map);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_head = reinterpret_cast<unsigned*>(base + params.sq_off.head);
+    ring->sq_tail = reinterpret_cast<unsigned*>(base + params.sq_off.tail);
+    ring->sq_mask =
+        reinterpret_cast<unsigned*>(base + params.sq_off.ring_mask);
+    ring->sq_array = reinterpret_cast<unsigned*>(base + params.sq_off.array);
+    ring->cq_head = reinterpret_cast<unsigned*>(base + params.cq_off.head);
+    ring->cq_tail = reinterpret_cast<unsigned*>(base + params.cq_off.tail);
+    ring->cq_mask =
+        reinterpret_cast<unsigned*>(base + params.cq_off.ring_mask);
+    ring->cqes = reinterpret_cast<io_uring_cqe*>(base + params.cq_off.cqes);
+
+    // Submission slot i always names entry i.
+    for (unsigned i = 0; i < params.sq_entries; i++) {
+        ring->sq_array[i] = i;
+    }
+
+    ring->slots.resize(RING_SEND_SLOTS);
+    for (uint32_t i = RING_SEND_SLOTS; i > 0; i--) {
+        ring->free_slots.push_back(i - 1);
+    }
+
+    return ring;
+}
+
+IoRing::~IoRing() {
+    for (auto& group : this->groups) {
+        if (group.ring != nullptr) {
+            munmap(group.ring, group.count * sizeof(io_uring_buf));
+        }
+    }
+    if (this->sqes != nullptr) {
+        munmap(this->sqes, this->sqes_len);
+    }
+    if (this->sq_map != nullptr) {
+        munmap(this->sq_map, this->sq_map_len);
+    }
+    if (this->fd >= 0) {
+        close(this->fd);
+    }
+}
+
+auto IoRing::provide_buffers(uint16_t group, unsigned count) -> bool {
+    auto& buffers = this->groups.at(group);
+
+    // The kernel shares the ring of buffer addresses; the buffers
+    // themselves are plain memory it fills in place.
+    void* addr = mmap(nullptr, count * sizeof(io_uring_buf),
+                      PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (addr == MAP_FAILED) {
+        spdlog::warn("Fail to map buffer ring: {}", strerror(errno));
+        return false;
+    }
+    buffers.ring = static_cast<io_uring_buf_ring*>(addr);
+    buffers.count = count;
+    buffers.buffers = std::make_unique<uint8_t[]>(count * RING_BUFFER_SIZE);
+
+    io_uring_buf_reg reg{};
+    reg.ring_addr = reinterpret_cast<uint64_t>(addr);
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (syscall(__NR_io_uring_register, this->fd, IORING_REGISTER_PBUF_RING,
+                &reg, 1) < 0) {
+        spdlog::warn("Fail to register buffer ring: {}", strerror(errno));
+        return false;
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+        this->recycle(group, i);
+    }
+
+    // Every receive leaves room for the sender and no control data.
+    buffers.header.msg_namelen = sizeof(sockaddr_in);
+    return true;
+}
+
+auto IoRing::recv_multishot(int fd, uint16_t group, uint64_t tag) -> void {
+    io_uring_sqe* sqe = this->next_sqe();
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(&this->groups.at(group).header);
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = group;
+    sqe->user_data = tag;
+}
+
+auto IoRing::poll_multishot(int fd, uint64_t tag) -> void {
+    io_uring_sqe* sqe = this->next_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = tag;
+}
+
+auto IoRing::send(int fd, const uint8_t* data, size_t len,
+                  const sockaddr_in& to) -> bool {
+    if (this->free_slots.empty() || len > PACKET_SIZE) {
+        return false;
+    }
+
+    uint32_t index = this->free_slots.back();
+    this->free_slots.pop_back();
+
+    SendSlot& slot = this->slots[index];
+    std::memcpy(slot.data, data, len);
+    slot.to = to;
+    slot.iov = {.iov_base = slot.data, .iov_len = len};
+    slot.header = {};
+    slot.header.msg_name = &slot.to;
+    slot.header.msg_namelen = sizeof(slot.to);
+    slot.header.msg_iov = &slot.iov;
+    slot.header.msg_iovlen = 1;
+
+    io_uring_sqe* sqe = this->next_sqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(&slot.header);
+    sqe->len = 1;
+    sqe->user_data = RING_SEND_TAG | index;
+    return true;
+}
+
+auto IoRing::wait(std::chrono::milliseconds timeout) -> void {
+    auto seconds = std::chrono::duration_cast<std::chrono::seconds>(timeout);
+    __kernel_timespec ts{
+        .tv_sec = seconds.count(),
+        .tv_nsec = std::chrono::nanoseconds(timeout - seconds).count(),
+    };
+    io_uring_getevents_arg arg{
+        .sigmask = 0,
+        .sigmask_sz = _NSIG / 8,
+        .ts = reinterpret_cast<uint64_t>(&ts),
+    };
+
+    int ret = this->enter(1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                          &arg, sizeof(arg));
+    if (ret < 0 && errno != ETIME && errno != EINTR) {
+        spdlog::warn("io_uring wait failed: {}", strerror(errno));
+    }
+}
+
+auto IoRing::message(uint16_t group, const RingCompletion& completion)
+    -> std::optional<RingMessage> {
+    if (completion.res < 0 || !completion.has_buffer()) {
+        return {};
+    }
+
+    const auto& buffers = this->groups.at(group);
+    uint8_t* buf =
+        buffers.buffers.get() + completion.buffer_id() * RING_BUFFER_SIZE;
+    size_t len = completion.res;
+
+    size_t payload = sizeof(io_uring_recvmsg_out) +
+                     buffers.header.msg_namelen +
+                     buffers.header.msg_controllen;
+    if (len < payload) {
+        return {};
+    }
+
+    io_uring_recvmsg_out out;
+    std::memcpy(&out, buf, sizeof(out));
+    if ((out.flags & MSG_TRUNC) || payload + out.payloadlen > len) {
+        return {};
+    }
+
+    RingMessage message{.data = buf + payload, .len = out.payloadlen};
+    std::memcpy(&message.from, buf + sizeof(out),
+                std::min<size_t>(out.namelen, sizeof(message.from)));
+    return message;
+}
+
+auto IoRing::recycle(uint16_t group, uint16_t buffer_id) -> void {
+    auto& buffers = this->groups.at(group);
+    io_uring_buf_ring* ring = buffers.ring;
+    uint16_t tail = ring->tail;
+
+    // The ring tail overlays the first entry's `resv`, so entries are
+    // written field by field. They are indexed from the ring itself: in
+    // C++ the header's flexible `bufs` member lands past an empty struct.
+    auto entries = reinterpret_cast<io_uring_buf*>(ring);
+    io_uring_buf& buf = entries[tail & (buffers.count - 1)];
+    buf.addr = reinterpret_cast<uint64_t>(buffers.buffers.get() +
+                                          buffer_id * RING_BUFFER_SIZE);
+    buf.len = RING_BUFFER_SIZE;
+    buf.bid = buffer_id;
+
+    __atomic_store_n(&ring->tail, static_cast<uint16_t>(tail + 1),
+                     __ATOMIC_RELEASE);
+}
+
+auto IoRing::next_sqe() -> io_uring_sqe* {
+    unsigned tail = *this->sq_tail;
+    if (tail - __atomic_load_n(this->sq_head, __ATOMIC_ACQUIRE) >=
+        this->sq_entries) {
+        this->enter(0, 0, nullptr, 0);
+    }
+
+    // Without SQPOLL the kernel reads entries only inside enter(), so the
+    // tail may move before the caller fills the entry in.
+    io_uring_sqe* sqe = &this->sqes[tail & *this->sq_mask];
+    std::memset(sqe, 0, sizeof(*sqe));
+    __atomic_store_n(this->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    this->to_submit++;
+    return sqe;
+}
+
+auto IoRing::enter(unsigned min_complete, unsigned flags, const void* arg,
+                   size_t arg_size) -> int {
+    int ret = syscall(__NR_io_uring_enter, this->fd, this->to_submit,
+                      min_complete, flags, arg, arg_size);
+    if (ret > 0) {
+        this->to_submit -= std::min<unsigned>(ret, this->to_submit);
+    }
+    return ret;
+}
+
+auto IoRing::complete_send(const RingCompletion& completion) -> void {
+    this->free_slots.push_back(completion.tag & ~RING_SEND_TAG);
+    if (completion.res < 0) {
+        spdlog::warn("Fail to send response packet: {}",
+                     strerror(-completion.res));
+    }
+}
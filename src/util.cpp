@@ -14,6 +14,20 @@ auto parse_args(int argc, char* argv[]) -> std::pair<uint16_t, fs::path> {
     return {port, conf_path};
 }
 
+auto env_or(const char* name, size_t fallback) -> size_t {
+    const char* value = getenv(name);
+    if (value == nullptr) {
+        return fallback;
+    }
+
+    try {
+        return std::stoul(value);
+    } catch (const std::exception&) {
+        spdlog::warn("Ignore invalid {}={}", name, value);
+        return fallback;
+    }
+}
+
 auto trim(const std::string& str, TrimStrategy strategy) -> std::string {
     auto left = std::find_if(str.begin(), str.end(), strategy);
     auto right = std::find_if(str.rbegin(), str.rend(), strategy);
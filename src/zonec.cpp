@@ -0,0 +1,28 @@
+#include <iostream>
+#include <thread>
+
+#include "builder.hpp"
+#include "spdlog/spdlog.h"
+#include "util.hpp"
+
+int main(int argc, char* argv[]) {
+    spdlog::set_level(spdlog::level::info);
+    const char* level = getenv("LOG_LEVEL");
+    if (level != nullptr) {
+        spdlog::set_level(spdlog::level::from_str(level));
+    }
+
+    if (argc < 3) {
+        std::cerr << "usage: " << argv[0] << " <config-path> <image-path>\n";
+        exit(EXIT_FAILURE);
+    }
+
+    ServerBuilder()
+        .set_loaders(
+            env_or("LOAD_THREADS", std::thread::hardware_concurrency()))
+        .load_config(argv[1])
+        .register_defaults()
+        .compile(argv[2]);
+
+    return 0;
+}